@@ -1,14 +1,188 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iosfwd>
 #include <map>
+#include <vector>
+#include <utility>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 
 namespace hurl
 {
     typedef std::map<std::string,std::string> httpparams;
-    typedef std::map<std::string,std::string> httpheaders;
+
+    // An ordered list of parameters. Unlike httpparams, pairs are sent in
+    // the order given and a name may repeat, e.g.
+    //
+    //      httpparamlist{{"id", "1"}, {"id", "2"}}     // ?id=1&id=2
+    //
+    // A bare braced list passed to get or post, {{"id", "1"}}, is taken as
+    // httpparams, as it always was; name the type as above for a list.
+    typedef std::vector<std::pair<std::string,std::string>> httpparamlist;
+
+    // A braced list of params, e.g. {{"q", "hurl"}}; taken as httpparams.
+    // Overloads taking it are preferred for a braced list, which would
+    // otherwise be ambiguous between httpparams and httpparamlist.
+    typedef std::initializer_list<httpparams::value_type> httpparaminit;
+
+    //
+    // Well-known header names. Headers with these names are indexed as
+    // they are received, so looking them up by id, e.g.
+    //
+    //      resp.header(hurl::h::content_encoding)
+    //
+    // is a constant-time array access.
+    //
+    namespace h
+    {
+        enum id
+        {
+            accept_ranges,
+            age,
+            cache_control,
+            connection,
+            content_disposition,
+            content_encoding,
+            content_language,
+            content_length,
+            content_location,
+            content_range,
+            content_type,
+            date,
+            etag,
+            expires,
+            last_modified,
+            link,
+            location,
+            pragma,
+            retry_after,
+            server,
+            set_cookie,
+            strict_transport_security,
+            transfer_encoding,
+            vary,
+            via,
+            www_authenticate,
+
+            count
+        };
+    }
+
+    //
+    // httpheaders
+    //  Response headers, stored back to back in a single buffer. Names are
+    //  kept in lower case and matched case-insensitively. A name may occur
+    //  more than once (e.g. Set-Cookie); every occurrence is kept, in the
+    //  order received.
+    //
+    //  The string_views handed out point into the container and are valid
+    //  until it is modified or destroyed.
+    //
+    class httpheaders
+    {
+    public:
+        typedef std::pair<std::string_view,std::string_view> field;
+
+        class const_iterator
+        {
+        public:
+            struct pointer
+            {
+                field value;
+                field const* operator->() const { return &value; }
+            };
+
+            const_iterator(char const* pos) : pos_(pos) { }
+
+            field operator*() const;
+            pointer operator->() const { return pointer{**this}; }
+            const_iterator& operator++();
+            const_iterator operator++(int);
+            bool operator==(const_iterator const& rhs) const { return pos_ == rhs.pos_; }
+            bool operator!=(const_iterator const& rhs) const { return pos_ != rhs.pos_; }
+
+        private:
+            char const* pos_;
+        };
+
+        httpheaders();
+
+        //
+        // add (name, value)
+        //  Append a header. The name is lowercased as it is stored.
+        //
+        void add                (std::string_view       name,
+                                 std::string_view       value);
+
+        //
+        // addline (line)
+        //  Parse a raw "Name: value" header line, as received on the wire,
+        //  and append it. Leading and trailing whitespace and the line
+        //  terminator are stripped from the value. Returns false, adding
+        //  nothing, if the line has no ':' before its end.
+        //
+        bool addline            (std::string_view       line);
+
+        void clear              ();
+        void reserve            (size_t                 bytes);
+        bool empty              () const;
+        size_t size             () const;
+
+        //
+        // count (name)
+        //  Number of headers with the given name.
+        //
+        size_t count            (std::string_view       name) const;
+
+        //
+        // get (name)
+        //  Value of the last header with the given name, or an empty view
+        //  if there is none.
+        //
+        std::string_view get    (std::string_view       name) const;
+
+        //
+        // get (id)
+        //  As above, for a well-known header, without searching.
+        //
+        std::string_view get    (h::id                  id) const;
+
+        //
+        // operator[] (name)
+        //  As get, but returns a copy.
+        //
+        std::string operator[]  (std::string_view       name) const;
+
+        //
+        // values (name)
+        //  All values for the given name, in the order received.
+        //
+        std::vector<std::string_view> values(std::string_view name) const;
+
+        const_iterator begin    () const;
+        const_iterator end      () const;
+
+    private:
+        // Record the header stored at offset if its name is well-known
+        void index              (size_t                 offset,
+                                 std::string_view       name);
+
+        // Each header is stored as its name and value lengths followed by
+        // the name and value bytes
+        std::string buf_;
+        size_t size_;
+
+        // For each well-known header, 1 + the offset of the last one
+        // received, or 0 if there was none
+        uint32_t known_[h::count];
+    };
 
     //
     // A response describes the result of a hurl HTTP request.
@@ -18,6 +192,10 @@ namespace hurl
         int status;
         httpheaders headers;
         std::string body;
+
+        // Shorthands for headers.get
+        std::string_view header (std::string_view       name) const;
+        std::string_view header (h::id                  id) const;
     };
 
 
@@ -30,6 +208,8 @@ namespace hurl
     {
     public:
         timeout();
+    protected:
+        explicit timeout(char const* what);
     };
 
     class resolve_error: public std::runtime_error
@@ -55,6 +235,691 @@ namespace hurl
         int code_;
     };
 
+    // Thrown without making a request while the circuit breaker for the
+    // request's host is open; see breakerpolicy
+    class circuit_open : public std::runtime_error
+    {
+    public:
+        explicit circuit_open(std::string const& host);
+    };
+
+    // Thrown when a request's deadline has passed, either before it is
+    // made or while it is in progress; see deadline
+    class deadline_exceeded : public timeout
+    {
+    public:
+        deadline_exceeded();
+    };
+
+
+    namespace detail
+    {
+        struct cache_access;
+        class bodysource;
+        struct body_access;
+        struct dictionary_access;
+    }
+
+    //
+    // cachestats
+    //  A snapshot of a cache's counters.
+    //
+    struct cachestats
+    {
+        uint64_t hits;          // lookups answered from the cache
+        uint64_t misses;        // lookups that went to the network
+        uint64_t stores;        // responses added or replaced
+        uint64_t evictions;     // entries dropped to stay within size
+        uint64_t revalidations; // stale entries refreshed by a 304
+        uint64_t stale;         // stale entries served (see cache)
+        size_t entries;         // entries currently held
+        size_t bytes;           // approximate memory currently held
+    };
+
+    //
+    // cache
+    //  An in-memory HTTP cache for GET responses, following the rules of
+    //  RFC 9111 for a private cache. Caching is opt-in: install a cache
+    //  with setcache (for the free functions) or client::setcache.
+    //
+    //  A response is stored only if it is fresh for some time, as given by
+    //  Cache-Control: max-age, Expires, or, failing those, a heuristic
+    //  based on Last-Modified. Responses with Cache-Control: no-store or
+    //  Vary: * are never stored. A stored response is served while its
+    //  current age (accounting for Age, Date and transfer delay) is below
+    //  its freshness lifetime, unless it was marked no-cache, and only to
+    //  requests whose headers match those listed in its Vary header.
+    //
+    //  Stale and no-cache responses that carry an ETag or Last-Modified
+    //  are kept for revalidation: the next request for them is sent with
+    //  If-None-Match/If-Modified-Since, and if the server answers 304 Not
+    //  Modified, the stored body is returned with the updated headers.
+    //
+    //  Responses may also be served stale, as allowed by the Cache-Control
+    //  extensions of RFC 5861. Within a response's stale-while-revalidate
+    //  window it is returned at once, while a background thread fetches a
+    //  fresh copy; the request made in the background has the same URL and
+    //  headers, but not a client's cookies. Each cache refreshes a URL once
+    //  at a time, and at most 16 refreshes run at once; beyond that, stale
+    //  responses are served until a refresh can start. Within its
+    //  stale-if-error window it is returned in place of a 5xx response,
+    //  connect_error, timeout, circuit_open, or a connection dropped by the
+    //  server. Stale responses served either way count as misses and as
+    //  stale in stats().
+    //
+    //  The cache is bounded to roughly maxbytes, evicting the least
+    //  recently used entries. Entries are spread over a number of shards,
+    //  each with its own lock, so one cache can be used from many threads
+    //  at once. Everything a cache is installed on shares its entries, so
+    //  don't share one between clients that hold different credentials.
+    //
+    class cache
+    {
+    public:
+        explicit cache(size_t maxbytes, unsigned shards = 16);
+        ~cache();
+
+        cachestats stats        () const;
+
+        // Drop all entries. Counters are not reset.
+        void clear              ();
+
+    private:
+        friend struct detail::cache_access;
+        class impl;
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        cache(cache const&);
+        cache& operator=(cache const&);
+    };
+
+    //
+    // diskcache
+    //  A persistent HTTP cache kept in a directory, applying the same rules
+    //  as cache. Any number of processes on a host may share a directory:
+    //  entries are written to temporary files and renamed into place, so
+    //  readers always see complete entries and never need a lock.
+    //
+    //  Bodies are stored once per distinct content, named by their SHA-256
+    //  digest, and are read through memory mappings. A GET served
+    //  from the disk cache costs one copy, from the page cache into the
+    //  response; a download is written straight from the mapping.
+    //
+    //  The directory is kept to roughly maxbytes by occasionally removing
+    //  the least recently used entries and any bodies no longer referenced.
+    //  Counters in stats() are for this process only; entries and bytes
+    //  describe the whole directory.
+    //
+    //  A diskcache can be used alone or behind an in-memory cache, in which
+    //  case entries read from disk are also kept in memory.
+    //
+    class diskcache
+    {
+    public:
+        diskcache(std::string const& directory, uint64_t maxbytes);
+        ~diskcache();
+
+        cachestats stats        () const;
+
+        // Remove all entries from the directory. Counters are not reset.
+        void clear              ();
+
+    private:
+        friend struct detail::cache_access;
+        class impl;
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        diskcache(diskcache const&);
+        diskcache& operator=(diskcache const&);
+    };
+
+    //
+    // setcache (cache)
+    //  Use the given cache for GET requests made with the free functions
+    //  below. Pass an empty pointer to stop caching.
+    //
+    void setcache               (std::shared_ptr<cache> c);
+
+    //
+    // setdiskcache (diskcache)
+    //  Use the given disk cache for GET requests and downloads made with
+    //  the free functions below. Pass an empty pointer to stop using it.
+    //
+    void setdiskcache           (std::shared_ptr<diskcache> c);
+
+    //
+    // setcoalescing (enabled)
+    //  When enabled, identical GET requests made at the same time with the
+    //  free functions below share one transfer, and each caller gets a copy
+    //  of its response (or its exception). Requests are identical if they
+    //  have the same URL and request headers. A caller that joins a
+    //  transfer still gives up after its own timeout. Off by default.
+    //
+    void setcoalescing          (bool enabled);
+
+
+    //
+    // retrypolicy
+    //  When, and how often, a failed request is tried again. The default
+    //  policy makes a single attempt.
+    //
+    //  Failures to resolve or connect are retried for any request, as the
+    //  server never saw it, and so are 429 Too Many Requests responses.
+    //  Timeouts, connections dropped by the server, and 408, 502, 503 and
+    //  504 responses are retried only for GETs and downloads, unless
+    //  retry_post is set. When retries run out, the last response is
+    //  returned, or the last exception thrown.
+    //
+    //  The nth retry waits backoff_ms * multiplier^(n-1), up to
+    //  max_backoff_ms, or, with jitter, a random time up to that. A 429
+    //  or 503 with a Retry-After header waits as long as it asks instead,
+    //  or isn't retried at all if that is longer than max_backoff_ms.
+    //
+    //  Retries also draw on a budget, so that a failing server isn't sent
+    //  a multiple of its normal load: each request earns budget_ratio
+    //  retries, up to budget_burst in hand. The free functions share one
+    //  budget, and each client has its own. The request body is kept as
+    //  sent and sent again, never rebuilt.
+    //
+    struct retrypolicy
+    {
+        retrypolicy();
+
+        int attempts;           // tries in all, including the first
+        int backoff_ms;         // delay before the first retry
+        double multiplier;      // growth of the delay with each retry
+        int max_backoff_ms;     // ceiling on any one delay
+        bool jitter;            // randomize delays between 0 and the above
+        bool retry_after;       // honour Retry-After on 429 and 503
+        bool retry_post;        // retry POSTs as if they were idempotent
+        double budget_ratio;    // retries earned per request
+        double budget_burst;    // most retries that can be in hand
+    };
+
+    //
+    // setretry (retrypolicy)
+    //  Set the retry policy for requests made with the free functions
+    //  below, unless a request's httpoptions gives its own.
+    //
+    void setretry               (retrypolicy const& policy);
+
+    //
+    // breakerpolicy
+    //  When requests to a failing host should fail fast. Each host (and
+    //  port) has a circuit breaker, shared by all requests in the process,
+    //  free functions and clients alike. Failures are connection errors,
+    //  timeouts and 5xx responses; retries count individually.
+    //
+    //  A host's circuit opens after the given number of failures in a
+    //  row, or when at least error_rate of its last window requests
+    //  failed. While open, requests to it throw circuit_open at once.
+    //  After open_ms, up to trials requests are let through: the circuit
+    //  closes when one succeeds, and opens again when one fails. Off by
+    //  default.
+    //
+    struct breakerpolicy
+    {
+        breakerpolicy();
+
+        bool enabled;
+        int failures;           // consecutive failures that open the circuit
+        double error_rate;      // share of failures that opens it, 0 to 1
+        int window;             // requests over which error_rate is measured
+        int open_ms;            // time open before trial requests
+        int trials;             // trial requests allowed at once
+    };
+
+    //
+    // setbreaker (breakerpolicy)
+    //  Set the circuit breaker policy for all requests.
+    //
+    void setbreaker             (breakerpolicy const& policy);
+
+    //
+    // hedgepolicy
+    //  Whether and when a GET sends a second, identical request while the
+    //  first is slow to complete. Whichever completes successfully first
+    //  is used and the other is abandoned; if both fail, the first one's
+    //  error is reported. This trades a little extra load for a shorter
+    //  tail of latencies, and suits idempotent requests to replicated
+    //  servers. Off by default.
+    //
+    //  The second request is sent after the given percentile of recent
+    //  GET latencies to the same host and port, or after delay_ms until
+    //  enough latencies have been seen, or always if percentile is 0. It
+    //  is made on a duplicate of the first request's handle, so a client's
+    //  cookies are not sent with it.
+    //
+    struct hedgepolicy
+    {
+        hedgepolicy();
+
+        bool enabled;
+        int delay_ms;           // fixed delay, or the default for percentile
+        double percentile;      // of recent latencies, e.g. 95; 0 for delay_ms
+    };
+
+    //
+    // sethedge (hedgepolicy)
+    //  Set the hedging policy for GETs made with the free functions below,
+    //  unless a request's httpoptions gives its own.
+    //
+    void sethedge               (hedgepolicy const& policy);
+
+    //
+    // dictionary
+    //  A zstd dictionary: data typical of the bodies it is used for, which
+    //  lets small bodies like the samples it was trained on, e.g. JSON
+    //  documents of a few KB with the same structure, compress to a
+    //  fraction of what they would alone. The peer needs the same
+    //  dictionary; a zstd frame names the one it was compressed with by id.
+    //
+    //  Compress request bodies with one by setting it in a
+    //  compressionpolicy, with a threshold low enough for them, e.g.
+    //
+    //      hurl::compressionpolicy policy;
+    //      policy.algorithm = hurl::compressionpolicy::zstd;
+    //      policy.threshold = 0;
+    //      policy.dictionary = hurl::dictionary(saved);
+    //
+    //  and decode responses compressed with one by passing it to
+    //  adddictionary. Training and using dictionaries needs
+    //  hurl built with HURL_WITH_ZSTD; without it, train and adddictionary
+    //  throw std::runtime_error.
+    //
+    class dictionary
+    {
+    public:
+        // No dictionary
+        dictionary();
+
+        // A dictionary from its content, e.g. as made by train and saved
+        explicit dictionary(std::string const& content);
+
+        dictionary(dictionary const& other);
+        dictionary& operator=(dictionary const& other);
+        ~dictionary();
+
+        //
+        // train (vector<string>, size_t)
+        //  Train a dictionary of up to capacity bytes on samples of the
+        //  bodies it is for. A few hundred samples are typical; too few
+        //  and training throws std::runtime_error.
+        //
+        static dictionary train (std::vector<std::string> const& samples,
+                                 size_t                 capacity = 112640);
+
+        explicit operator bool  () const;
+
+        std::string const& content() const;
+
+        // The id in its header, which zstd frames made with it carry; 0
+        // for raw content that isn't a zstd dictionary
+        uint32_t id             () const;
+
+    private:
+        class impl;
+        std::shared_ptr<impl> impl_;
+
+        friend struct detail::dictionary_access;
+    };
+
+    //
+    // adddictionary (dictionary)
+    //  Decode zstd responses compressed with the given dictionary, which
+    //  must have an id. Responses are requested with Accept-Encoding:
+    //  zstd whenever hurl is built with zstd.
+    //
+    void adddictionary          (dictionary const&      dict);
+
+    //
+    // compressionpolicy
+    //  Whether and how POST and PUT bodies are compressed. Bodies of at
+    //  least threshold bytes, or of unknown size, are sent compressed with
+    //  the matching Content-Encoding, which the server must accept.
+    //
+    //  A body of known size up to buffer_limit is compressed in full
+    //  before it is sent, with a Content-Length, and the same bytes are
+    //  sent again on a retry. Larger bodies, and those of unknown size, are
+    //  compressed a piece at a time as libcurl asks for them and sent
+    //  chunked, so compression overlaps sending. Their output is kept
+    //  while it is within buffer_limit, and a retry sends it again rather
+    //  than reading and compressing the body a second time.
+    //
+    //  Bodies that look incompressible are sent as-is: the byte entropy
+    //  of the first 4 KB gives the compressed size to expect, and if that
+    //  is more than max_ratio of the original, compressing is skipped.
+    //  This catches images, archives and other already compressed data.
+    //  The decisions are counted in stats().
+    //
+    //  Unless a policy is set, string bodies given to post of 10 KB or
+    //  more are gzipped unless they look incompressible; httpbody and
+    //  multipart bodies are sent as they are. Setting a policy, with
+    //  setcompression, client::setcompression or httpoptions, applies it
+    //  to all of them.
+    //
+    //  With threads other than 1, gzip splits the body into 128 KB blocks
+    //  and compresses that many at once, as pigz does, each block primed
+    //  with the 32 KB before it; the result is a single standard gzip
+    //  stream, a fraction of a percent larger. Worth it for bodies of
+    //  many MB, where deflate is slower than the network.
+    //
+    //  If the server answers a compressed body with 415 Unsupported Media
+    //  Type and an Accept-Encoding header that doesn't list the encoding
+    //  (RFC 7694), the body is sent again gzipped, if listed, or as-is,
+    //  provided it can be read again.
+    //
+    //  zstd and brotli are available when hurl is built with HURL_WITH_ZSTD
+    //  (and -lzstd) or HURL_WITH_BROTLI (and -lbrotlienc) defined, as
+    //  make ZSTD=1 or BROTLI=1 does; a request using one that isn't throws
+    //  std::runtime_error.
+    //
+    struct compressionpolicy
+    {
+        enum codec { none, gzip, zstd, brotli };
+
+        compressionpolicy();
+
+        codec algorithm;
+        size_t threshold;       // smallest body compressed, in bytes
+        int level;              // the codec's level; -1 for a default
+        double max_ratio;       // estimated ratio above which not to bother;
+                                // 1 to compress regardless
+        hurl::dictionary dictionary;    // for zstd, if set
+        unsigned threads;       // for gzip; 0 for one per core
+        uint64_t buffer_limit;  // largest body compressed before sending
+    };
+
+    //
+    // setcompression (compressionpolicy)
+    //  Set the compression policy for requests made with the free
+    //  functions below, unless a request's httpoptions gives its own.
+    //
+    void setcompression         (compressionpolicy const& policy);
+
+    //
+    // deadline
+    //  A point in time by which a request must be done, such as the time
+    //  an upstream caller gives up on the work the request is part of.
+    //  Unlike a timeout, one deadline can be passed to a chain of requests:
+    //  each transfer, retries included, gets only the time left, and one
+    //  started after the deadline has passed throws deadline_exceeded
+    //  without being made. A default-constructed deadline never passes.
+    //
+    //      hurl::httpoptions options;
+    //      options.deadline = hurl::deadline::after(2000);
+    //      hurl::get(url, options);                // up to 2 seconds ...
+    //      hurl::post(other, data, options);       // ... for both
+    //
+    class deadline
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        deadline();
+        explicit deadline(clock::time_point when);
+
+        // The deadline ms milliseconds from now
+        static deadline after(long ms);
+
+        // Whether there is a deadline at all
+        explicit operator bool() const;
+
+        bool passed() const;
+
+        // Whole milliseconds left, 0 once passed
+        long remaining_ms() const;
+
+        clock::time_point when() const;
+
+    private:
+        clock::time_point when_;
+        bool set_;
+    };
+
+    //
+    // httpoptions
+    //  Settings for a single request, taken by the overloads of get, post
+    //  and download that accept them.
+    //
+    struct httpoptions
+    {
+        httpoptions();
+
+        // Time, in seconds, to wait before failing. 0 means no limit for
+        // the free functions, and the client's timeout for a client.
+        int timeout;
+
+        // Time limits in milliseconds, each 0 for none. All of them fail
+        // the transfer with hurl::timeout.
+        long timeout_ms;            // the whole transfer; overrides timeout
+        long connect_timeout_ms;    // connecting, including name lookup
+        long first_byte_timeout_ms; // from the start to the first response byte
+
+        // Stall detection: fail with hurl::timeout if the transfer averages
+        // less than low_speed_limit bytes per second for low_speed_time
+        // seconds. Both must be set.
+        long low_speed_limit;
+        long low_speed_time;
+
+        // The time by which the request must be done, on top of the limits
+        // above; if unset, the one given to client::setdeadline, if any
+        hurl::deadline deadline;
+
+        // The retry policy for this request; if unset, the one given to
+        // setretry or client::setretry
+        std::optional<retrypolicy> retry;
+
+        // The hedging policy for this request, if a GET; if unset, the one
+        // given to sethedge or client::sethedge
+        std::optional<hedgepolicy> hedge;
+
+        // The compression policy for this request's body, if any; if unset,
+        // the one given to setcompression or client::setcompression
+        std::optional<compressionpolicy> compression;
+    };
+
+    //
+    // httpstats
+    //  Counters for all requests made in this process.
+    //
+    struct httpstats
+    {
+        uint64_t attempts;          // transfers started, retries included
+        uint64_t retries;           // transfers that were retries
+        uint64_t exhausted;         // requests that failed on their last attempt
+        uint64_t over_budget;       // retries not made for lack of budget
+        uint64_t hedges;            // second requests sent by hedged GETs
+        uint64_t hedges_won;        // ... that completed first
+        uint64_t circuits_opened;   // times a host's circuit opened
+        uint64_t circuit_rejected;  // requests failed with circuit_open
+        uint64_t compressed;        // request bodies sent compressed
+        uint64_t compression_skipped; // ... not, as they looked incompressible
+    };
+
+    httpstats stats             ();
+
+    //
+    // httpbody
+    //  A request body that is read as it is sent rather than copied into
+    //  a string: from a file, an istream, a function, or memory the caller
+    //  already holds. libcurl asks for the next piece only when it is
+    //  ready to send it, so a slow server slows down the reading instead
+    //  of data piling up in between. When the size isn't known, the body
+    //  is sent with chunked transfer encoding.
+    //
+    //  A body is a handle to its source, and copies share it, so a body
+    //  must not be used by two requests at once. A body that can be read
+    //  again from the start (memory, a file, a seekable fd or stream) is
+    //  sent again when a request is retried; others are sent once,
+    //  whatever the retry policy. The fd, stream, function or memory
+    //  given must outlive the requests the body is used for.
+    //
+    class httpbody
+    {
+    public:
+        // A function to fill buffer with the next piece of the body, up to
+        // size bytes, returning how many it wrote; 0 at the end. It may
+        // throw to abort the request, which rethrows the exception.
+        typedef std::function<size_t (char* buffer, size_t size)> reader;
+
+        //
+        // file (string)
+        //  The contents of the file at path, which is opened now and
+        //  closed along with the last copy of the body. Throws
+        //  std::runtime_error if the file can't be opened.
+        //
+        static httpbody file    (std::string const&     path);
+
+        //
+        // fd (int)
+        //  What can be read from fd, from its current offset to the end.
+        //  The fd is not closed. Regular files are sized, and read with
+        //  pread so that the offset is left alone.
+        //
+        static httpbody fd      (int                    fd);
+
+        //
+        // stream (istream, size)
+        //  What can be read from in, from its current position to the end,
+        //  which is size bytes, or -1 if unknown.
+        //
+        static httpbody stream  (std::istream&          in,
+                                 int64_t                size = -1);
+
+        //
+        // view (string_view)
+        //  The bytes data refers to, handed to libcurl where they are
+        //  rather than copied in through a read callback. They must stay
+        //  alive and unchanged until the requests the body is used for
+        //  are done.
+        //
+        static httpbody view    (std::string_view       data);
+
+        //
+        // buffer (shared_ptr<string const>)
+        //  As for view, but the body shares ownership of the string, which
+        //  is freed with the last body or copy of the pointer. To send one
+        //  buffer from several threads at once, make a body for each.
+        //  An empty pointer is an empty body.
+        //
+        static httpbody buffer  (std::shared_ptr<std::string const> data);
+
+        //
+        // join (vector<httpbody>)
+        //  The given bodies one after another, read from where each one is
+        //  as it is sent: e.g. a header, a large blob and a trailer held
+        //  separately, sent without first copying them together. The size
+        //  is known if all of theirs are, and the whole can be sent again
+        //  if each of them can. The parts are shared with the bodies given.
+        //
+        //      post(url, httpbody::join({httpbody::view(header),
+        //                                httpbody::buffer(blob),
+        //                                httpbody::view(trailer)}));
+        //
+        static httpbody join    (std::vector<httpbody> const& parts);
+
+        //
+        // callback (reader, size)
+        //  The pieces returned by read, which add up to size bytes, or -1
+        //  if unknown. A callback body is never sent more than once.
+        //
+        static httpbody callback(reader                 read,
+                                 int64_t                size = -1);
+
+        // Bytes in all, or -1 if not known in advance
+        int64_t size            () const;
+
+    private:
+        explicit httpbody(std::shared_ptr<detail::bodysource> source);
+
+        std::shared_ptr<detail::bodysource> source_;
+
+        friend struct detail::body_access;
+    };
+
+    //
+    // multipart
+    //  A multipart/form-data body (RFC 7578), as sent by HTML forms with
+    //  file inputs. Parts are added in order and read as the body is
+    //  sent, so however large the files, memory use stays at libcurl's
+    //  buffers plus the part headers.
+    //
+    //      multipart form;
+    //      form.field("title", "snapshot")
+    //          .file("data", "/var/backups/snapshot.tar");
+    //      post(url, form);
+    //
+    class multipart
+    {
+    public:
+        multipart();
+
+        //
+        // field (string, string)
+        //  A plain form field.
+        //
+        multipart& field        (std::string const&     name,
+                                 std::string const&     value);
+
+        //
+        // file (string, string, string)
+        //  The file at path, opened now, sent with its base name as the
+        //  filename. Throws std::runtime_error if it can't be opened.
+        //
+        multipart& file         (std::string const&     name,
+                                 std::string const&     path,
+                                 std::string const&     content_type =
+                                     "application/octet-stream");
+
+        //
+        // part (string, httpbody, string, string)
+        //  A part read from body, e.g. a callback; with a filename if one
+        //  is given, and a Content-Type if one is given.
+        //
+        multipart& part         (std::string const&     name,
+                                 httpbody const&        body,
+                                 std::string const&     filename = std::string(),
+                                 std::string const&     content_type = std::string());
+
+        //
+        // content_type ()
+        //  The Content-Type to send the body with, giving its boundary.
+        //
+        std::string content_type() const;
+
+        //
+        // body ()
+        //  The whole body, parts and delimiters. It shares the parts'
+        //  sources, so only one body from a form may be sent at a time.
+        //
+        httpbody body           () const;
+
+    private:
+        void add(std::string const& headers, httpbody const& body);
+
+        std::string boundary_;
+        std::vector<httpbody> parts_;
+    };
+
+
+    //
+    // escape (string)
+    //  Percent-encode every character outside the RFC 3986 unreserved set
+    //  (letters, digits, '-', '.', '_' and '~'). This is the encoding used
+    //  for query strings and form data built from httpparams.
+    //
+    std::string escape          (std::string const&     s);
+
+    //
+    // unescape (string)
+    //  Decode %XX sequences. A '%' that is not followed by two hex digits
+    //  is kept as-is, and '+' is not translated to a space.
+    //
+    std::string unescape        (std::string const&     s);
+
 
     //
     // get (string)
@@ -82,6 +947,18 @@ namespace hurl
                                  httpparams const&      params,
                                  int                    timeout = 0);
 
+    //
+    // get (string, httpparamlist)
+    //  As above, but query parameters are sent in order and may repeat.
+    //
+    httpresponse get            (std::string const&     url,
+                                 httpparamlist const&   params,
+                                 int                    timeout = 0);
+
+    httpresponse get            (std::string const&     url,
+                                 httpparaminit          params,
+                                 int                    timeout = 0);
+
     //
     // post (string, httpparams)
     //  Submit an HTTP POST request with given parameters. The parameters
@@ -95,6 +972,18 @@ namespace hurl
                                  httpparams const&      params,
                                  int                    timeout = 0);
 
+    //
+    // post (string, httpparamlist)
+    //  As above, but form fields are sent in order and may repeat.
+    //
+    httpresponse post           (std::string const&     url,
+                                 httpparamlist const&   params,
+                                 int                    timeout = 0);
+
+    httpresponse post           (std::string const&     url,
+                                 httpparaminit          params,
+                                 int                    timeout = 0);
+
     //
     // post (string, string)
     //  Submit an HTTP POST request with raw data.
@@ -108,12 +997,68 @@ namespace hurl
                                  std::string const&     data,
                                  int                    timeout = 0);
 
+    //
+    // get (string, httpoptions)
+    // post (string, string, httpoptions)
+    //  As above, with settings given by options.
+    //
+    httpresponse get            (std::string const&     url,
+                                 httpoptions const&     options);
+
+    httpresponse post           (std::string const&     url,
+                                 std::string const&     data,
+                                 httpoptions const&     options);
+
+    //
+    // post (string, httpbody)
+    // put (string, httpbody)
+    //  Submit an HTTP POST or PUT request whose body is read as it is sent;
+    //  see httpbody.
+    //
+    httpresponse post           (std::string const&     url,
+                                 httpbody const&        body,
+                                 int                    timeout = 0);
+
+    httpresponse post           (std::string const&     url,
+                                 httpbody const&        body,
+                                 httpoptions const&     options);
+
+    httpresponse put            (std::string const&     url,
+                                 httpbody const&        body,
+                                 int                    timeout = 0);
+
+    httpresponse put            (std::string const&     url,
+                                 httpbody const&        body,
+                                 httpoptions const&     options);
+
+    //
+    // post (string, multipart)
+    //  Submit an HTTP POST request with a multipart/form-data body; see
+    //  multipart.
+    //
+    httpresponse post           (std::string const&     url,
+                                 multipart const&       form,
+                                 int                    timeout = 0);
+
+    httpresponse post           (std::string const&     url,
+                                 multipart const&       form,
+                                 httpoptions const&     options);
+
     //
     // download (string, string)
-    //  Download a file via HTTP GET to the local filesystem. If a file with
-    //  the specified path already exists and is writable, it will be
-    //  truncated before the download begins, even if the server returns an
-    //  error status.
+    //  Download a file via HTTP GET to the local filesystem. The file is
+    //  written to localpath + ".part" and renamed over localpath once a
+    //  2xx response completes. If the transfer fails or the server returns
+    //  any other status, any existing file is left alone and the partial
+    //  file removed; the result reports the status.
+    //
+    //  The ETag and Last-Modified of a downloaded file are kept in a
+    //  "user.hurl.validators" extended attribute, and its modification
+    //  time is set from Last-Modified. If the file at localpath is one
+    //  downloaded that way and not modified since, the request is made
+    //  conditional on them; if the server answers 304 Not Modified, the
+    //  file is left untouched and the result is the 304. Any other file at
+    //  localpath is simply replaced.
     //
     //  url         The URL of the file to download
     //  localpath   Path in the local filesystem to save the file to
@@ -123,12 +1068,17 @@ namespace hurl
                                  std::string const&     localpath,
                                  int                    timeout = 0);
 
+    httpresponse download       (std::string const&     url,
+                                 std::string const&     localpath,
+                                 httpoptions const&     options);
+
     //
     // downloadtarball (string, string, string)
     //  Download a tar-encoded archive to the specified path and extract it
     //  in the specified directory. This function does not follow redirects,
-    //  and if the server responds with any HTTP status besides 200 OK, it
-    //  will not attempt to extract from the downloaded file.
+    //  and if the server responds with any HTTP status besides 200 OK, or
+    //  304 Not Modified for a tarball already at localpath, it will not
+    //  attempt to extract from the downloaded file.
     //
     //  url         The URL of the tarball to retrieve
     //  localpath   Path in local filesystem to save tarball to
@@ -201,27 +1151,115 @@ namespace hurl
         //
         void setcookie          (std::string const&     value);
 
+        //
+        // setcache (cache)
+        //  Use the given cache for GET requests made with this client. The
+        //  cache may be shared with other clients and the free functions.
+        //  Pass an empty pointer to stop caching.
+        //
+        void setcache           (std::shared_ptr<cache> c);
+
+        //
+        // setdiskcache (diskcache)
+        //  Use the given disk cache for GET requests and downloads made
+        //  with this client. Pass an empty pointer to stop using it.
+        //
+        void setdiskcache       (std::shared_ptr<diskcache> c);
+
+        //
+        // setretry (retrypolicy)
+        //  Set the retry policy for requests made with this client, unless
+        //  a request's httpoptions gives its own.
+        //
+        void setretry           (retrypolicy const&     policy);
+
+        //
+        // sethedge (hedgepolicy)
+        //  Set the hedging policy for GETs made with this client, unless a
+        //  request's httpoptions gives its own.
+        //
+        void sethedge           (hedgepolicy const&     policy);
+
+        //
+        // setcompression (compressionpolicy)
+        //  Set the compression policy for request bodies sent with this
+        //  client, unless a request's httpoptions gives its own.
+        //
+        void setcompression     (compressionpolicy const& policy);
+
+        //
+        // setdeadline (deadline)
+        //  Set the deadline for requests made with this client, unless a
+        //  request's httpoptions gives its own; e.g. the deadline of the
+        //  work the client is being used for. Pass deadline() to clear it.
+        //
+        void setdeadline        (deadline const&        until);
+
         httpresponse get        (std::string const&     path);
 
+        httpresponse get        (std::string const&     path,
+                                 httpoptions const&     options);
+
         httpresponse get        (std::string const&     path,
                                  httpparams const&      params);
 
+        httpresponse get        (std::string const&     path,
+                                 httpparamlist const&   params);
+
+        httpresponse get        (std::string const&     path,
+                                 httpparaminit          params);
+
         httpresponse post       (std::string const&     path,
                                  std::string const&     data);
 
+        httpresponse post       (std::string const&     path,
+                                 std::string const&     data,
+                                 httpoptions const&     options);
+
         httpresponse post       (std::string const&     path,
                                  httpparams const&      params);
 
+        httpresponse post       (std::string const&     path,
+                                 httpparamlist const&   params);
+
+        httpresponse post       (std::string const&     path,
+                                 httpparaminit          params);
+
+        httpresponse post       (std::string const&     path,
+                                 httpbody const&        body);
+
+        httpresponse post       (std::string const&     path,
+                                 httpbody const&        body,
+                                 httpoptions const&     options);
+
+        httpresponse put        (std::string const&     path,
+                                 httpbody const&        body);
+
+        httpresponse put        (std::string const&     path,
+                                 httpbody const&        body,
+                                 httpoptions const&     options);
+
+        httpresponse post       (std::string const&     path,
+                                 multipart const&       form);
+
+        httpresponse post       (std::string const&     path,
+                                 multipart const&       form,
+                                 httpoptions const&     options);
+
         httpresponse download   (std::string const&     path,
                                  std::string const&     localpath);
 
+        httpresponse download   (std::string const&     path,
+                                 std::string const&     localpath,
+                                 httpoptions const&     options);
+
         httpresponse downloadtarball(std::string const& path,
                                  std::string const&     localpath,
                                  std::string const&     extractdir);
 
     private:
         class impl;
-        std::auto_ptr<impl> impl_;
+        std::unique_ptr<impl> impl_;
 
         // Noncopyable
         client(client const&);
@@ -0,0 +1,845 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <cctype>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hurl.h"
+
+extern "C"
+{
+#include <curl/curl.h>
+#include <zlib.h>
+}
+
+namespace hurl {
+    namespace detail {
+        template<typename Params>
+        std::string serialize(Params const&);
+        std::string gzip(std::string_view);
+        std::string gzip(std::string_view, unsigned threads);
+        std::string gunzip(std::string const&);
+    }
+}
+
+//
+// Microbenchmarks for hurl internals. Each command runs the current
+// implementation against the one it replaced (kept here verbatim for
+// reference) and reports the mean time per call.
+//
+
+double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template<typename F>
+double timeit(F f, int iterations)
+{
+    double start = now();
+    for (int i = 0; i < iterations; ++i)
+        f();
+    return (now() - start) / iterations;
+}
+
+void report(std::string const& name, double seconds)
+{
+    std::cout << "  " << name << ": " << seconds * 1e6 << " us/op\n";
+}
+
+//
+// serialize
+//
+std::string legacy_serialize(hurl::httpparams const& params)
+{
+    std::stringstream ss;
+    for (hurl::httpparams::const_iterator it = params.begin();
+            it != params.end(); ++it)
+    {
+        if (it != params.begin())
+            ss << "&";
+        char* name = curl_easy_escape(NULL, it->first.c_str(), it->first.size());
+        char* value = curl_easy_escape(NULL, it->second.c_str(), it->second.size());
+        ss << name << "=" << value;
+        curl_free(name);
+        curl_free(value);
+    }
+    return ss.str();
+}
+
+hurl::httpparams make_form(int fields)
+{
+    // A mix of plain identifiers, free text and binary-ish values,
+    // roughly what a bulk form post carries
+    hurl::httpparams params;
+    for (int i = 0; i < fields; ++i)
+    {
+        std::ostringstream name, value;
+        name << "field_" << i;
+        switch (i % 3)
+        {
+        case 0: value << "value" << i; break;
+        case 1: value << "some free text & punctuation = " << i << "?"; break;
+        case 2: value << "caf\xc3\xa9/\xe2\x82\xac" << i << "~ok"; break;
+        }
+        params[name.str()] = value.str();
+    }
+    return params;
+}
+
+struct serialize_legacy
+{
+    hurl::httpparams const& p;
+    void operator()() const { legacy_serialize(p); }
+};
+
+struct serialize_current
+{
+    hurl::httpparams const& p;
+    void operator()() const { hurl::detail::serialize(p); }
+};
+
+int bench_serialize(int fields)
+{
+    hurl::httpparams params = make_form(fields);
+    if (legacy_serialize(params) != hurl::detail::serialize(params))
+    {
+        std::cerr << "serialize: output mismatch\n";
+        return 1;
+    }
+
+    int iterations = 2000000 / fields + 1;
+    std::cout << "serialize (" << fields << " fields, "
+              << iterations << " iterations)\n";
+    serialize_legacy legacy = { params };
+    serialize_current current = { params };
+    report("stringstream + curl_easy_escape", timeit(legacy, iterations));
+    report("detail::serialize", timeit(current, iterations));
+    return 0;
+}
+
+//
+// params: build and serialize an httpparams map vs an httpparamlist
+//
+struct params_map
+{
+    std::vector<std::string> const& names;
+    void operator()() const
+    {
+        hurl::httpparams params;
+        for (size_t i = 0; i < names.size(); ++i)
+            params[names[i]] = names[i];
+        hurl::detail::serialize(params);
+    }
+};
+
+struct params_list
+{
+    std::vector<std::string> const& names;
+    void operator()() const
+    {
+        hurl::httpparamlist params;
+        params.reserve(names.size());
+        for (size_t i = 0; i < names.size(); ++i)
+            params.emplace_back(names[i], names[i]);
+        hurl::detail::serialize(params);
+    }
+};
+
+int bench_params(int fields)
+{
+    std::vector<std::string> names;
+    for (int i = 0; i < fields; ++i)
+    {
+        std::ostringstream name;
+        name << "field_" << (i * 7919) % fields;
+        names.push_back(name.str());
+    }
+
+    int iterations = 2000000 / fields + 1;
+    std::cout << "params (" << fields << " fields, "
+              << iterations << " iterations)\n";
+    params_map map = { names };
+    params_list list = { names };
+    report("httpparams", timeit(map, iterations));
+    report("httpparamlist", timeit(list, iterations));
+    return 0;
+}
+
+//
+// escape / unescape
+//
+std::string make_text(size_t size)
+{
+    // Free-text search query: mostly words, some punctuation and UTF-8
+    static const char* words[] = {
+        "distributed", "cache", "r\xc3\xa9sum\xc3\xa9", "how to", "C++",
+        "latency", "p99", "\"exact phrase\"", "a&b", "100%", "na\xc3\xafve"
+    };
+    std::string text;
+    for (size_t i = 0; text.size() < size; ++i)
+    {
+        if (i)
+            text += ' ';
+        text += words[(i * 7) % (sizeof(words) / sizeof(words[0]))];
+    }
+    text.resize(size);
+    return text;
+}
+
+struct escape_curl
+{
+    std::string const& s;
+    void operator()() const
+    {
+        char* e = curl_easy_escape(NULL, s.c_str(), s.size());
+        std::string result(e);
+        curl_free(e);
+    }
+};
+
+struct escape_current
+{
+    std::string const& s;
+    void operator()() const { hurl::escape(s); }
+};
+
+struct unescape_curl
+{
+    std::string const& s;
+    void operator()() const
+    {
+        int size = 0;
+        char* u = curl_easy_unescape(NULL, s.c_str(), s.size(), &size);
+        std::string result(u, size);
+        curl_free(u);
+    }
+};
+
+struct unescape_current
+{
+    std::string const& s;
+    void operator()() const { hurl::unescape(s); }
+};
+
+int bench_escape(int size)
+{
+    std::string text = make_text(size);
+    char* e = curl_easy_escape(NULL, text.c_str(), text.size());
+    std::string escaped(e);
+    curl_free(e);
+    if (hurl::escape(text) != escaped || hurl::unescape(escaped) != text)
+    {
+        std::cerr << "escape: output mismatch\n";
+        return 1;
+    }
+
+    int iterations = 200000000 / size + 1;
+    std::cout << "escape (" << size << " bytes, "
+              << iterations << " iterations)\n";
+    escape_curl ecurl = { text };
+    escape_current ecurrent = { text };
+    unescape_curl ucurl = { escaped };
+    unescape_current ucurrent = { escaped };
+    report("curl_easy_escape", timeit(ecurl, iterations));
+    report("hurl::escape", timeit(ecurrent, iterations));
+    report("curl_easy_unescape", timeit(ucurl, iterations));
+    report("hurl::unescape", timeit(ucurrent, iterations));
+    return 0;
+}
+
+//
+// headers: tokenize a CDN-style response header block
+//
+static const char* cdn_headers[] = {
+    "HTTP/1.1 200 OK\r\n",
+    "Content-Type: application/json; charset=utf-8\r\n",
+    "Content-Length: 18344\r\n",
+    "Connection: keep-alive\r\n",
+    "Date: Fri, 16 Oct 2026 12:00:00 GMT\r\n",
+    "Last-Modified: Thu, 15 Oct 2026 08:31:07 GMT\r\n",
+    "ETag: \"5f2a9c0e3b7d41a8b9e6c2d1f0a3b4c5\"\r\n",
+    "Cache-Control: public, max-age=300, stale-while-revalidate=60\r\n",
+    "Content-Encoding: gzip\r\n",
+    "Vary: Accept-Encoding, Origin\r\n",
+    "Server: AmazonS3\r\n",
+    "Accept-Ranges: bytes\r\n",
+    "Access-Control-Allow-Origin: *\r\n",
+    "Access-Control-Expose-Headers: ETag, Content-Length, X-Request-Id\r\n",
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains; preload\r\n",
+    "X-Content-Type-Options: nosniff\r\n",
+    "X-Frame-Options: SAMEORIGIN\r\n",
+    "Referrer-Policy: strict-origin-when-cross-origin\r\n",
+    "X-Cache: Hit from cloudfront\r\n",
+    "Via: 1.1 3b1f0c9e8d7a6b5c4d3e2f1a0b9c8d7e.cloudfront.net (CloudFront)\r\n",
+    "X-Amz-Cf-Pop: FRA56-P7\r\n",
+    "X-Amz-Cf-Id: 7hGz0xQ1-Rb3kLmNoPqRsTuVwXyZaBcDeFgHiJkLmNoPqRsTuVw==\r\n",
+    "Age: 127\r\n",
+    "X-Request-Id: 9c1d2e3f-4a5b-6c7d-8e9f-0a1b2c3d4e5f\r\n",
+    "Set-Cookie: session=eyJhbGciOiJIUzI1NiJ9.eyJzdWIiOiIxMjM0NTY3ODkwIn0.abc; Path=/; Secure; HttpOnly\r\n",
+    "Set-Cookie: AWSALB=Wk1Yn3Zp0qRsTuVwXyZ; Expires=Fri, 23 Oct 2026 12:00:00 GMT; Path=/\r\n",
+    "Set-Cookie: AWSALBCORS=Wk1Yn3Zp0qRsTuVwXyZ; Expires=Fri, 23 Oct 2026 12:00:00 GMT; Path=/; SameSite=None; Secure\r\n",
+    "Timing-Allow-Origin: *\r\n",
+    "Alt-Svc: h3=\":443\"; ma=86400\r\n",
+    "Server-Timing: cdn-cache; desc=HIT, edge; dur=1, origin; dur=0\r\n",
+    "Content-Security-Policy: default-src 'self'; img-src 'self' data: https:; script-src 'self'\r\n",
+    "Permissions-Policy: geolocation=(), microphone=(), camera=()\r\n",
+    "\r\n",
+};
+
+std::string trim_legacy(std::string const& s)
+{
+    size_t b = s.find_first_not_of(" \t\r\n\f\v");
+    size_t e = s.find_last_not_of(" \t\r\n\f\v");
+    return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+}
+
+struct headers_legacy
+{
+    std::vector<std::string> const& lines;
+    void operator()() const
+    {
+        std::map<std::string,std::string> headers;
+        for (size_t i = 0; i < lines.size(); ++i)
+        {
+            std::string header(lines[i].data(), lines[i].size());
+            size_t cpos = header.find(':');
+            if (cpos != std::string::npos)
+            {
+                std::string name = header.substr(0, cpos);
+                for (size_t j = 0; j < name.size(); ++j)
+                    name[j] = std::tolower(name[j]);
+                headers[name] = trim_legacy(header.substr(cpos+1));
+            }
+        }
+    }
+};
+
+struct headers_current
+{
+    std::vector<std::string> const& lines;
+    void operator()() const
+    {
+        hurl::httpheaders headers;
+        headers.reserve(1024);
+        for (size_t i = 0; i < lines.size(); ++i)
+            headers.addline(lines[i]);
+    }
+};
+
+int bench_headers(int count)
+{
+    size_t available = sizeof(cdn_headers) / sizeof(cdn_headers[0]) - 2;
+    if (count < 1 || size_t(count) > available)
+        count = available;
+    std::vector<std::string> lines;
+    lines.push_back(cdn_headers[0]);
+    for (int i = 0; i < count; ++i)
+        lines.push_back(cdn_headers[i + 1]);
+    lines.push_back("\r\n");
+
+    int iterations = 200000;
+    std::cout << "headers (" << count << " header lines, "
+              << iterations << " iterations)\n";
+    headers_legacy legacy = { lines };
+    headers_current current = { lines };
+    report("string + substr + tolower + trim into std::map", timeit(legacy, iterations));
+    report("httpheaders::addline", timeit(current, iterations));
+    return 0;
+}
+
+//
+// post: send a large body to a local server that discards it, copying
+// it into a string first as detail::post did (it took its data by value)
+// vs sending it from where it is
+//
+class sink
+{
+public:
+    // Listen on an ephemeral loopback port, serving every connection on
+    // its own detached thread for the rest of the process
+    sink() : port_(0)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t size = sizeof(addr);
+        if (fd == -1 || bind(fd, (sockaddr*)&addr, size) || listen(fd, 16) ||
+                getsockname(fd, (sockaddr*)&addr, &size))
+            throw std::runtime_error("sink: could not listen");
+        port_ = ntohs(addr.sin_port);
+        std::thread(&sink::serve, fd).detach();
+    }
+
+    std::string url() const
+    {
+        std::ostringstream url;
+        url << "http://127.0.0.1:" << port_;
+        return url.str();
+    }
+
+    // Body bytes received by all sinks, as sent
+    static std::atomic<uint64_t>& received()
+    {
+        static std::atomic<uint64_t> total(0);
+        return total;
+    }
+
+private:
+    static void serve(int fd)
+    {
+        int conn;
+        while ((conn = accept(fd, NULL, NULL)) != -1)
+            std::thread(&sink::discard, conn).detach();
+    }
+
+    // Buffered reads from a connection; each returns false once the
+    // client has hung up
+    struct reader
+    {
+        int conn;
+        std::string pending;
+
+        bool fill()
+        {
+            char buf[1 << 16];
+            ssize_t n = read(conn, buf, sizeof(buf));
+            if (n <= 0)
+                return false;
+            pending.append(buf, n);
+            return true;
+        }
+
+        // Read through the next delimiter, setting out to what preceded it
+        bool until(char const* delimiter, std::string& out)
+        {
+            size_t end;
+            while ((end = pending.find(delimiter)) == std::string::npos)
+                if (!fill())
+                    return false;
+            out.assign(pending, 0, end);
+            pending.erase(0, end + std::strlen(delimiter));
+            return true;
+        }
+
+        bool skip(size_t size)
+        {
+            while (pending.size() < size)
+            {
+                size -= pending.size();
+                pending.clear();
+                if (!fill())
+                    return false;
+            }
+            pending.erase(0, size);
+            return true;
+        }
+    };
+
+    // Read requests, with Content-Length or chunked bodies, and answer
+    // each with an empty 200, until the client hangs up
+    static void discard(int conn)
+    {
+        reader in = { conn, std::string() };
+        std::string head, line;
+        while (in.until("\r\n\r\n", head))
+        {
+            size_t length = 0;
+            bool chunked = false;
+            for (size_t i = 0; i < head.size(); ++i)
+            {
+                if (strncasecmp(&head[i], "\ncontent-length:", 16) == 0)
+                    length = std::strtoul(&head[i + 16], NULL, 10);
+                if (strncasecmp(&head[i], "\ntransfer-encoding: chunked", 27) == 0)
+                    chunked = true;
+            }
+
+            bool ok = true;
+            if (chunked)
+            {
+                size_t size;
+                do
+                {
+                    ok = in.until("\r\n", line);
+                    size = std::strtoul(line.c_str(), NULL, 16);
+                    ok = ok && in.skip(size + 2);
+                    received() += size;
+                } while (ok && size > 0);
+            }
+            else
+            {
+                ok = in.skip(length);
+                received() += length;
+            }
+
+            static const char reply[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+            if (!ok || write(conn, reply, sizeof(reply) - 1) < 0)
+                break;
+        }
+        close(conn);
+    }
+
+    int port_;
+};
+
+struct post_copy
+{
+    hurl::client& c;
+    std::string const& data;
+    void operator()() const
+    {
+        std::string copy(data);
+        c.post("/", hurl::httpbody::view(copy));
+    }
+};
+
+struct post_view
+{
+    hurl::client& c;
+    std::string const& data;
+    void operator()() const { c.post("/", hurl::httpbody::view(data)); }
+};
+
+struct post_buffer
+{
+    hurl::client& c;
+    std::shared_ptr<std::string const> const& data;
+    void operator()() const { c.post("/", hurl::httpbody::buffer(data)); }
+};
+
+int bench_post(int megabytes)
+{
+    sink server;
+    hurl::client c(server.url());
+    hurl::compressionpolicy none;
+    none.algorithm = hurl::compressionpolicy::none;
+    c.setcompression(none);
+    std::shared_ptr<std::string const> data =
+        std::make_shared<std::string const>(size_t(megabytes) << 20, 'x');
+    if (c.post("/", hurl::httpbody::buffer(data)).status != 200)
+    {
+        std::cerr << "post: bad response from sink\n";
+        return 1;
+    }
+
+    int iterations = 1000 / megabytes + 2;
+    std::cout << "post (" << megabytes << " MB, "
+              << iterations << " iterations)\n";
+    post_copy copy = { c, *data };
+    post_view view = { c, *data };
+    post_buffer buffer = { c, data };
+    report("copy into std::string, then send", timeit(copy, iterations));
+    report("httpbody::view", timeit(view, iterations));
+    report("httpbody::buffer", timeit(buffer, iterations));
+    return 0;
+}
+
+//
+// compress: post a mixed corpus, as services send it, with and without
+// compression, and with compression skipped for bodies that look
+// incompressible
+//
+std::vector<std::string> make_corpus(size_t size)
+{
+    std::mt19937 random(42);
+    std::vector<std::string> corpus;
+
+    // JSON documents
+    std::string json;
+    for (int i = 0; json.size() < size; ++i)
+    {
+        std::ostringstream doc;
+        doc << "{\"id\":" << i << ",\"name\":\"item " << i % 97
+            << "\",\"tags\":[\"a\",\"b\"],\"price\":" << (i * 37) % 1000 << ".99,"
+            << "\"text\":\"" << make_text(64 + i % 64) << "\"}\n";
+        json += doc.str();
+    }
+    json.resize(size);
+    corpus.push_back(json);
+
+    // Already compressed: JPEG or archive-like random bytes, and gzipped JSON
+    std::string noise(size, '\0');
+    for (size_t i = 0; i < size; ++i)
+        noise[i] = char(random());
+    corpus.push_back(noise);
+    corpus.push_back(hurl::detail::gzip(json + json + json + json).substr(0, size));
+
+    // Protobuf-like records: short fields around compressed blobs
+    std::string records;
+    while (records.size() < size)
+    {
+        records += "\x0a\x10record-header-\x12";
+        records += noise.substr(records.size() % (size - 512), 500);
+    }
+    records.resize(size);
+    corpus.push_back(records);
+
+    // Plain text log lines
+    corpus.push_back(make_text(size));
+    return corpus;
+}
+
+struct post_corpus
+{
+    hurl::client& c;
+    std::vector<std::string> const& corpus;
+    void operator()() const
+    {
+        for (size_t i = 0; i < corpus.size(); ++i)
+            c.post("/", corpus[i]);
+    }
+};
+
+int bench_compress(int kilobytes)
+{
+    sink server;
+    hurl::client c(server.url());
+    std::vector<std::string> corpus = make_corpus(size_t(kilobytes) << 10);
+    uint64_t total = 0;
+    for (size_t i = 0; i < corpus.size(); ++i)
+        total += corpus[i].size();
+
+    int iterations = 20000 / kilobytes + 2;
+    std::cout << "compress (" << corpus.size() << " bodies of " << kilobytes << " KB, "
+              << iterations << " iterations)\n";
+
+    static const char* names[] = { "none", "gzip always", "gzip adaptive" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        hurl::compressionpolicy policy;
+        policy.algorithm = mode ? hurl::compressionpolicy::gzip : hurl::compressionpolicy::none;
+        policy.threshold = 0;
+        policy.max_ratio = mode == 2 ? 0.9 : 1.0;
+        c.setcompression(policy);
+
+        hurl::httpstats before = hurl::stats();
+        uint64_t sent = sink::received();
+        post_corpus run = { c, corpus };
+        report(names[mode], timeit(run, iterations));
+        hurl::httpstats after = hurl::stats();
+        std::cout << "    sent " << 100.0 * (sink::received() - sent) / (total * iterations)
+                  << "% of the corpus; compressed " << after.compressed - before.compressed
+                  << ", skipped " << after.compression_skipped - before.compression_skipped
+                  << "\n";
+    }
+    return 0;
+}
+
+//
+// pgzip: gzip a large JSON body on one thread, as detail::gzip does, and
+// split into blocks across several
+//
+struct gzip_threads
+{
+    std::string const& data;
+    unsigned threads;
+    void operator()() const { hurl::detail::gzip(data, threads); }
+};
+
+int bench_pgzip(int megabytes)
+{
+    std::string data = make_corpus(size_t(megabytes) << 20)[0];
+    int iterations = 200 / megabytes + 2;
+    std::cout << "pgzip (" << megabytes << " MB, " << iterations << " iterations, "
+              << std::thread::hardware_concurrency() << " cores)\n";
+
+    gzip_threads single = { data, 1 };
+    report("detail::gzip", timeit(single, iterations));
+    static const unsigned counts[] = { 2, 4, 8 };
+    for (unsigned threads : counts)
+    {
+        gzip_threads parallel = { data, threads };
+        std::ostringstream name;
+        name << threads << " threads";
+        report(name.str(), timeit(parallel, iterations));
+    }
+    std::cout << "    " << hurl::detail::gzip(data).size() << " bytes on one thread, "
+              << hurl::detail::gzip(data, 8).size() << " on 8\n";
+    return 0;
+}
+
+//
+// deflate: one-shot gzip and gunzip of JSON bodies of typical sizes, with
+// zlib as before (gunzip growing its buffer from 10 KB) vs the current
+// backend, libdeflate if built with HURL_WITH_LIBDEFLATE
+//
+std::string legacy_gzip(std::string_view input)
+{
+    z_stream stream;
+
+    stream.next_in = (unsigned char*)input.data();
+    stream.avail_in = input.size();
+
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    if (Z_OK != deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS+16,
+            MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+    {
+        throw std::runtime_error("error initializing deflate");
+    }
+
+    // Add 12 for old versions of zlib that don't correctly include header size
+    unsigned long maxLen = 12 + deflateBound(&stream, input.size());
+    std::vector<unsigned char> dest(maxLen);
+
+    stream.next_out = &dest.front();
+    stream.avail_out = dest.size();
+
+    if (Z_STREAM_END != deflate(&stream, Z_FINISH))
+    {
+        deflateEnd(&stream);
+        throw std::runtime_error("failed to completely deflate");
+    }
+
+    std::string result((const char*)&dest.front(), (size_t)stream.total_out);
+    deflateEnd(&stream);
+    return result;
+}
+
+std::string legacy_gunzip(std::string const& input)
+{
+    const unsigned long INIT_BUFFER_SIZE = 10240;
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = (unsigned char*)input.data();
+    stream.avail_in = input.size();
+
+    if (Z_OK != inflateInit2(&stream, MAX_WBITS+16))
+    {
+        throw std::runtime_error("error initializing inflate");
+    }
+
+    // Allocate an initial buffer
+    std::vector<unsigned char> dest(INIT_BUFFER_SIZE);
+    stream.next_out = &dest.front();
+    stream.avail_out = dest.size();
+
+    int rc;
+    do
+    {
+        rc = inflate(&stream, Z_SYNC_FLUSH);
+
+        if (rc == Z_OK)
+        {
+            // Reallocate buffer and continue
+            size_t oldSize = dest.size();
+            dest.resize(dest.size() * 2);
+            stream.next_out = &dest.front() + oldSize;
+            stream.avail_out = dest.size() - oldSize;
+        }
+        else if (rc != Z_STREAM_END)
+        {
+            inflateEnd(&stream);
+            std::cerr << "Error code: " << rc << "\n"
+                      << "Message: " << stream.msg << "\n";
+            throw std::runtime_error("failed to completely inflate");
+        }
+    } while(rc != Z_STREAM_END);
+
+    inflateEnd(&stream);
+    return std::string((const char*)&dest.front(), (size_t)stream.total_out);
+}
+
+struct gzip_with
+{
+    std::string (*gzip)(std::string_view);
+    std::string const& data;
+    void operator()() const { gzip(data); }
+};
+
+struct gunzip_with
+{
+    std::string (*gunzip)(std::string const&);
+    std::string const& data;
+    void operator()() const { gunzip(data); }
+};
+
+int bench_deflate(int kilobytes)
+{
+#if defined(HURL_WITH_LIBDEFLATE)
+    static const char backend[] = "libdeflate";
+#else
+    static const char backend[] = "zlib";
+#endif
+    static const int sizes[] = { 1, 8, 64, 512, 4096 };
+    for (int size : sizes)
+    {
+        if (kilobytes && size != kilobytes)
+            continue;
+        std::string data = make_corpus(size_t(size) << 10)[0];
+        std::string zipped = hurl::detail::gzip(data);
+        int iterations = 20000 / size + 2;
+        std::cout << "deflate (" << size << " KB to " << zipped.size() << " bytes, "
+                  << iterations << " iterations, " << backend << ")\n";
+
+        gzip_with before = { &legacy_gzip, data };
+        gzip_with after = { &hurl::detail::gzip, data };
+        report("gzip, zlib", timeit(before, iterations));
+        report(std::string("gzip, ") + backend, timeit(after, iterations));
+        gunzip_with unbefore = { &legacy_gunzip, zipped };
+        gunzip_with unafter = { &hurl::detail::gunzip, zipped };
+        report("gunzip, zlib growing", timeit(unbefore, iterations));
+        report(std::string("gunzip, ") + backend + " sized", timeit(unafter, iterations));
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cout << "usage: " << argv[0] << " <benchmark> [size]\n";
+        return 1;
+    }
+    std::string cmd(argv[1]);
+
+    if (cmd == "serialize") {
+        return bench_serialize(argc > 2 ? std::atoi(argv[2]) : 500);
+    }
+    else if (cmd == "params") {
+        return bench_params(argc > 2 ? std::atoi(argv[2]) : 50);
+    }
+    else if (cmd == "headers") {
+        return bench_headers(argc > 2 ? std::atoi(argv[2]) : 30);
+    }
+    else if (cmd == "escape") {
+        return bench_escape(argc > 2 ? std::atoi(argv[2]) : 2048);
+    }
+    else if (cmd == "post") {
+        return bench_post(argc > 2 ? std::atoi(argv[2]) : 1);
+    }
+    else if (cmd == "compress") {
+        return bench_compress(argc > 2 ? std::atoi(argv[2]) : 256);
+    }
+    else if (cmd == "pgzip") {
+        return bench_pgzip(argc > 2 ? std::atoi(argv[2]) : 16);
+    }
+    else if (cmd == "deflate") {
+        return bench_deflate(argc > 2 ? std::atoi(argv[2]) : 0);
+    }
+    else {
+        std::cerr << "Unrecognized benchmark.\n";
+        return 1;
+    }
+}
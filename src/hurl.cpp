@@ -9,21 +9,77 @@
 #include <exception>
 #include <stdexcept>
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <ctime>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <cmath>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HURL_AVX2_DISPATCH
+#endif
 
 extern "C"
 {
 #include <zlib.h>
 #include <curl/curl.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <libtar.h>
 }
 
+// Optional request encodings; see compressionpolicy
+#if defined(HURL_WITH_ZSTD)
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#if defined(HURL_WITH_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+// Optional one-shot gzip backend; see detail::gzip
+#if defined(HURL_WITH_LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+
 namespace hurl
 {
     timeout::timeout()
         : std::runtime_error(curl_easy_strerror(CURLE_OPERATION_TIMEDOUT))
     { }
 
+    timeout::timeout(char const* what)
+        : std::runtime_error(what)
+    { }
+
+    deadline_exceeded::deadline_exceeded()
+        : timeout("Deadline exceeded")
+    { }
+
     resolve_error::resolve_error()
         : std::runtime_error(curl_easy_strerror(CURLE_COULDNT_RESOLVE_HOST))
     { }
@@ -44,8 +100,11 @@ namespace hurl
 
     namespace detail
     {
+        bool refreshing();
+
         // Ensure that curl_global_init gets called at program startup,
-        // and that curl_global_cleanup is called before exit
+        // and that curl_global_cleanup is called before exit, unless
+        // background refreshes are still using libcurl
         static struct ensure_init
         {
             ensure_init()
@@ -54,7 +113,8 @@ namespace hurl
             }
             ~ensure_init()
             {
-                curl_global_cleanup();
+                if (!refreshing())
+                    curl_global_cleanup();
             }
         } moo;
 
@@ -63,7 +123,11 @@ namespace hurl
         public:
             handle()
                 : handle_(curl_easy_init()),
-                  headers_(NULL)
+                  headers_(NULL),
+                  first_byte_ms_(0),
+                  first_byte_late_(false),
+                  timeout_ms_(0),
+                  deadline_bound_(false)
             {
                 if (handle_ == NULL)
                     throw std::runtime_error("curl_easy_init failed");
@@ -86,14 +150,95 @@ namespace hurl
                 headers_ = NULL;
             }
 
+            // Take ownership of a handle made elsewhere, e.g. by duplicate
+            explicit handle(CURL* adopted)
+                : handle_(adopted),
+                  headers_(NULL),
+                  first_byte_ms_(0),
+                  first_byte_late_(false),
+                  timeout_ms_(0),
+                  deadline_bound_(false)
+            {
+                if (handle_ == NULL)
+                    throw std::runtime_error("curl_easy_duphandle failed");
+            }
+
             void perform()
             {
-                // Set stored headers, then perform
+                ready();
+                if (first_byte_ms_ <= 0)
+                {
+                    check(curl_easy_perform(handle_));
+                    return;
+                }
+
+                // Drive the transfer on a multi handle, so as to wake up in
+                // time to enforce the first-byte limit
+                std::unique_ptr<CURLM, CURLMcode (*)(CURLM*)> multi(curl_multi_init(),
+                                                                    &curl_multi_cleanup);
+                if (!multi)
+                    throw std::runtime_error("curl_multi_init failed");
+                curl_multi_add_handle(multi.get(), handle_);
+                int code = -1;
+                while (code == -1)
+                {
+                    int running = 0, queued = 0;
+                    curl_multi_perform(multi.get(), &running);
+                    while (CURLMsg* msg = curl_multi_info_read(multi.get(), &queued))
+                        if (msg->msg == CURLMSG_DONE)
+                            code = msg->data.result;
+                    if (code != -1)
+                        break;
+
+                    long wait = 1000;
+                    if (!first_byte_seen())
+                    {
+                        wait = first_byte_ms_ - elapsed_ms();
+                        if (wait <= 0)
+                        {
+                            first_byte_late_ = true;
+                            code = CURLE_ABORTED_BY_CALLBACK;
+                            break;
+                        }
+                    }
+                    curl_multi_poll(multi.get(), NULL, 0, int(std::min(wait, 1000L)), NULL);
+                }
+                curl_multi_remove_handle(multi.get(), handle_);
+                check(code);
+            }
+
+            // Set stored headers and the time left before the deadline,
+            // for a transfer about to be performed
+            void ready()
+            {
                 setopt(CURLOPT_HTTPHEADER, headers_);
-                int code = curl_easy_perform(handle_);
+                if (until_)
+                {
+                    long left = until_.remaining_ms();
+                    if (left <= 0)
+                        throw deadline_exceeded();
+                    deadline_bound_ = timeout_ms_ <= 0 || left < timeout_ms_;
+                    setopt(CURLOPT_TIMEOUT_MS, deadline_bound_ ? left : timeout_ms_);
+                }
+                start();
+            }
+
+            // Note the start of a transfer, for limit_first_byte
+            void start()
+            {
+                started_ = std::chrono::steady_clock::now();
+                first_byte_late_ = false;
+            }
+
+            // Throw the exception for a failed transfer's result code
+            void check(int code) const
+            {
                 if (CURLE_OK == code)
                     return;
-                if (CURLE_OPERATION_TIMEDOUT == code)
+                if (CURLE_OPERATION_TIMEDOUT == code && deadline_bound_)
+                    throw deadline_exceeded();
+                if (CURLE_OPERATION_TIMEDOUT == code ||
+                    (CURLE_ABORTED_BY_CALLBACK == code && first_byte_late_))
                     throw timeout();
                 if (CURLE_COULDNT_RESOLVE_HOST == code)
                     throw resolve_error();
@@ -103,10 +248,47 @@ namespace hurl
                     throw curl_error(code);
             }
 
+            // A new handle with the same options, headers and limits, for
+            // an identical request. This handle is left as it is, so it can
+            // be duplicated while its transfer is running.
+            std::unique_ptr<handle> duplicate() const
+            {
+                std::unique_ptr<handle> copy(new handle(curl_easy_duphandle(handle_)));
+                for (curl_slist const* h = headers_; h; h = h->next)
+                    copy->add_header(h->data);
+                copy->limit_deadline(until_, timeout_ms_);
+                copy->limit_first_byte(first_byte_ms_);
+                return copy;
+            }
+
             void reset()
             {
                 clear_headers();
                 curl_easy_reset(handle_);
+                first_byte_ms_ = 0;
+                timeout_ms_ = 0;
+                until_ = deadline();
+                deadline_bound_ = false;
+            }
+
+            // Limit transfers to the time left before until, or timeout_ms
+            // if that is sooner and not 0, setting the limit as each starts
+            void limit_deadline(deadline const& until, long timeout_ms)
+            {
+                until_ = until;
+                timeout_ms_ = timeout_ms;
+            }
+
+            // Fail transfers with timeout if no part of the response has
+            // arrived within ms of starting; 0 for no limit
+            void limit_first_byte(long ms)
+            {
+                first_byte_ms_ = ms;
+                if (ms <= 0)
+                    return;
+                setopt(CURLOPT_NOPROGRESS, 0L);
+                setopt(CURLOPT_XFERINFOFUNCTION, &handle::progress);
+                setopt(CURLOPT_XFERINFODATA, this);
             }
 
             template<typename T, typename U>
@@ -130,44 +312,165 @@ namespace hurl
                 return handle_;
             }
 
+            // Request headers to be sent, as "Name: value" lines
+            curl_slist const* headers() const
+            {
+                return headers_;
+            }
+
         private:
+            bool first_byte_seen() const
+            {
+                curl_off_t first_byte = 0;
+                curl_easy_getinfo(handle_, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+                return first_byte != 0;
+            }
+
+            long elapsed_ms() const
+            {
+                return long(std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - started_).count());
+            }
+
+            // Progress callback enforcing the first-byte limit, for
+            // transfers driven elsewhere, e.g. hedged ones. It is called
+            // a few times a second.
+            static int progress(void* data, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+            {
+                handle* self = static_cast<handle*>(data);
+                if (!self->first_byte_seen() && self->elapsed_ms() > self->first_byte_ms_)
+                {
+                    self->first_byte_late_ = true;
+                    return 1;
+                }
+                return 0;
+            }
+
             CURL* handle_;
             curl_slist* headers_;
+            long first_byte_ms_;
+            bool first_byte_late_;
+            std::chrono::steady_clock::time_point started_;
+            deadline until_;
+            long timeout_ms_;
+            bool deadline_bound_;   // whether the deadline set the timeout
         };
 
-        // Why are these not in the standard library?
-        inline std::string ltrim(std::string const& s)
+        inline char lower(char c)
         {
-            using namespace std;
-            return string(
-                find_if(s.begin(), s.end(), not1(ptr_fun<int, int>(isspace))),
-                s.end());
+            return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
         }
 
-        inline std::string rtrim(std::string const& s)
+        // Case-insensitive comparison, for header names and tokens
+        inline bool iequals(std::string_view a, std::string_view b)
         {
-            using namespace std;
-            return string(
-                s.begin(),
-                find_if(s.rbegin(), s.rend(), not1(ptr_fun<int, int>(isspace))).base());
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); ++i)
+                if (lower(a[i]) != lower(b[i]))
+                    return false;
+            return true;
         }
 
-        inline std::string trim(std::string const& s)
+        inline bool is_ows(char c)
         {
-            return ltrim(rtrim(s));
+            return c == ' ' || c == '\t';
         }
 
-        inline std::string tolower(std::string const& s)
+        inline std::string_view trim(std::string_view s)
         {
-            std::string result(s);
-            std::transform(result.begin(), result.end(), result.begin(), (int(*)(int))std::tolower);
-            return result;
+            while (!s.empty() && is_ows(s.front()))
+                s.remove_prefix(1);
+            while (!s.empty() && is_ows(s.back()))
+                s.remove_suffix(1);
+            return s;
         }
 
         //
         // gzip compression support
+        //  Whole buffers are compressed and decompressed with libdeflate
+        //  when hurl is built with HURL_WITH_LIBDEFLATE (and -ldeflate, as
+        //  make LIBDEFLATE=1 does), which is several times faster than zlib
+        //  at it, and otherwise with zlib. zlib-ng built with ZLIB_COMPAT
+        //  replaces zlib at link time, with no change here. Streamed bodies
+        //  always use zlib.
         //
-        std::string gzip(std::string const& input)
+
+        // The uncompressed size recorded in a gzip trailer, modulo 2^32,
+        // or 0 if there isn't one or it's more than deflate can expand to
+        size_t gzip_size_hint(std::string const& input)
+        {
+            if (input.size() < 18)
+                return 0;
+            unsigned char const* p = (unsigned char const*)input.data() + input.size() - 4;
+            size_t size = uint32_t(p[0]) | uint32_t(p[1]) << 8 |
+                          uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+            return size / 1032 <= input.size() ? size : 0;
+        }
+
+#if defined(HURL_WITH_LIBDEFLATE)
+        // Allocating these is costly; each thread keeps its own
+        struct deflaters
+        {
+            libdeflate_compressor* compressor;
+            libdeflate_decompressor* decompressor;
+
+            ~deflaters()
+            {
+                if (compressor)
+                    libdeflate_free_compressor(compressor);
+                if (decompressor)
+                    libdeflate_free_decompressor(decompressor);
+            }
+        };
+        thread_local deflaters thread_deflaters = { NULL, NULL };
+
+        std::string gzip(std::string_view input)
+        {
+            libdeflate_compressor*& compressor = thread_deflaters.compressor;
+            if (compressor == NULL)
+                compressor = libdeflate_alloc_compressor(6);
+            if (compressor == NULL)
+                throw std::runtime_error("error initializing deflate");
+
+            std::string result(libdeflate_gzip_compress_bound(compressor, input.size()), '\0');
+            size_t size = libdeflate_gzip_compress(compressor, input.data(), input.size(),
+                                                   &result[0], result.size());
+            if (size == 0)
+                throw std::runtime_error("failed to completely deflate");
+            result.resize(size);
+            return result;
+        }
+
+        std::string gunzip(std::string const& input)
+        {
+            libdeflate_decompressor*& decompressor = thread_deflaters.decompressor;
+            if (decompressor == NULL)
+                decompressor = libdeflate_alloc_decompressor();
+            if (decompressor == NULL)
+                throw std::runtime_error("error initializing inflate");
+
+            // Exactly the right size, unless the trailer is wrong or
+            // another member follows
+            size_t hint = gzip_size_hint(input);
+            std::string result(hint ? hint : std::max<size_t>(10240, input.size() * 4), '\0');
+            for (;;)
+            {
+                size_t used, size;
+                libdeflate_result rc = libdeflate_gzip_decompress_ex(decompressor,
+                    input.data(), input.size(), &result[0], result.size(), &used, &size);
+                if (rc == LIBDEFLATE_SUCCESS)
+                {
+                    result.resize(size);
+                    return result;
+                }
+                if (rc != LIBDEFLATE_INSUFFICIENT_SPACE)
+                    throw std::runtime_error("failed to completely inflate");
+                result.resize(result.size() * 2);
+            }
+        }
+#else
+        std::string gzip(std::string_view input)
         {
             z_stream stream;
 
@@ -185,11 +488,10 @@ namespace hurl
             }
 
             // Add 12 for old versions of zlib that don't correctly include header size
-            unsigned long maxLen = 12 + deflateBound(&stream, input.size());
-            std::vector<unsigned char> dest(maxLen);
+            std::string result(12 + deflateBound(&stream, input.size()), '\0');
 
-            stream.next_out = &dest.front();
-            stream.avail_out = dest.size();
+            stream.next_out = (unsigned char*)&result[0];
+            stream.avail_out = result.size();
 
             if (Z_STREAM_END != deflate(&stream, Z_FINISH))
             {
@@ -197,14 +499,13 @@ namespace hurl
                 throw std::runtime_error("failed to completely deflate");
             }
 
-            std::string result((const char*)&dest.front(), (size_t)stream.total_out);
+            result.resize(stream.total_out);
             deflateEnd(&stream);
             return result;
         }
 
         std::string gunzip(std::string const& input)
         {
-            const unsigned long INIT_BUFFER_SIZE = 10240;
             z_stream stream;
             stream.zalloc = Z_NULL;
             stream.zfree = Z_NULL;
@@ -217,38 +518,34 @@ namespace hurl
                 throw std::runtime_error("error initializing inflate");
             }
 
-            // Allocate an initial buffer
-            std::vector<unsigned char> dest(INIT_BUFFER_SIZE);
-            stream.next_out = &dest.front();
-            stream.avail_out = dest.size();
+            // Inflate straight into the result, sized from the trailer; one
+            // spare byte lets inflate finish without running out of room
+            size_t hint = gzip_size_hint(input);
+            std::string result(hint ? hint + 1 : std::max<size_t>(10240, input.size() * 4), '\0');
+            stream.next_out = (unsigned char*)&result[0];
+            stream.avail_out = result.size();
 
             int rc;
             do
             {
-                rc = inflate(&stream, Z_SYNC_FLUSH);
-
-                if (rc == Z_OK)
-                {
-                    // Reallocate buffer and continue
-                    size_t oldSize = dest.size();
-                    dest.resize(dest.size() * 2);
-                    stream.next_out = &dest.front() + oldSize;
-                    stream.avail_out = dest.size() - oldSize;
-                }
-                else if (rc != Z_STREAM_END)
+                if (stream.avail_out == 0)
                 {
-                    inflateEnd(&stream);
-                    std::cerr << "Error code: " << rc << "\n"
-                              << "Message: " << stream.msg << "\n";
-                    // TODO: use std::vector for buffering; better exception safety
-                    // also, no need to explicitly copy when reallocating
-                    throw std::runtime_error("failed to completely inflate");
+                    size_t used = result.size();
+                    result.resize(used * 2);
+                    stream.next_out = (unsigned char*)&result[used];
+                    stream.avail_out = result.size() - used;
                 }
-            } while(rc != Z_STREAM_END);
+                rc = inflate(&stream, Z_NO_FLUSH);
+            } while (rc == Z_OK);
 
+            size_t size = stream.total_out;
             inflateEnd(&stream);
-            return std::string((const char*)&dest.front(), (size_t)stream.total_out);
+            if (rc != Z_STREAM_END)
+                throw std::runtime_error("failed to completely inflate");
+            result.resize(size);
+            return result;
         }
+#endif
 
         extern "C" size_t streamfunc(void* ptr, size_t size, size_t nmemb, std::ostream* out)
         {
@@ -258,213 +555,5039 @@ namespace hurl
 
         extern "C" size_t headerfunc(void* ptr, size_t size, size_t nmemb, httpresponse* resp)
         {
-            std::string header(static_cast<const char*>(ptr), size * nmemb);
+            std::string_view line(static_cast<const char*>(ptr), size * nmemb);
 
-            // Per RFC 2616, each header line consists of a token followed
-            // by a ':' and then a value, preceded by any amount of leading
-            // whitespace.
-            size_t cpos = header.find(':');
-            if (cpos != std::string::npos)
+            // A status line starts a new response (after an interim 1xx
+            // response, say); keep only the final response's headers
+            if (line.compare(0, 5, "HTTP/") == 0)
             {
-                std::string name = tolower(header.substr(0, cpos));
-                std::string value = trim(header.substr(cpos+1));
-                resp->headers[name] = value;
+                resp->headers.clear();
+                return line.size();
             }
 
-            return size * nmemb;
+            // Per RFC 2616, each header line consists of a token followed
+            // by a ':' and then a value, preceded by any amount of leading
+            // whitespace. Lines without a ':' are ignored.
+            resp->headers.addline(line);
+            return line.size();
+        }
+
+        //
+        // URL encoding
+        //  Every byte outside the RFC 3986 unreserved set (ALPHA, DIGIT,
+        //  '-', '.', '_', '~') is percent-encoded, exactly as
+        //  curl_easy_escape does, but without a heap allocation per call.
+        //
+        static const unsigned char unreserved[256] = {
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0,
+                1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+                0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+                1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,
+                0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+                1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+        };
+
+        inline char hexdigit(unsigned char c)
+        {
+            return "0123456789ABCDEF"[c & 0xf];
         }
 
-        std::string serialize(httpparams const& params)
+        // Value of a hex digit, or -1 if c is not one
+        inline int hexvalue(unsigned char c)
         {
-            // Serialize HTTP params in a URL-encoded form appropriate
-            // for a query string or POST-fields request body.
-            std::stringstream ss;
-            for (httpparams::const_iterator it = params.begin();
-                    it != params.end(); ++it)
+            if (c >= '0' && c <= '9') return c - '0';
+            c |= 0x20;
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            return -1;
+        }
+
+        //
+        // Vectorized scanning
+        //  The kernels below classify 16 (SSE2) or 32 (AVX2) bytes at a
+        //  time, returning a bitmask with bit i set if byte i is
+        //  unreserved. The comparisons are signed, so bytes >= 0x80 never
+        //  fall in any of the ranges. Setting bit 0x20 folds A-Z onto a-z
+        //  without moving anything else into that range.
+        //
+#if defined(__SSE2__)
+        inline unsigned unreserved_mask16(const char* p)
+        {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+            __m128i alpha = _mm_and_si128(
+                    _mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+            __m128i digit = _mm_and_si128(
+                    _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                    _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+            __m128i mark = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('-')),
+                                 _mm_cmpeq_epi8(c, _mm_set1_epi8('.'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('_')),
+                                 _mm_cmpeq_epi8(c, _mm_set1_epi8('~'))));
+            return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), mark));
+        }
+
+        inline unsigned byte_mask16(const char* p, char b)
+        {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(b)));
+        }
+
+        // Bit i set if byte i is CR or LF
+        inline unsigned eol_mask16(__m128i c)
+        {
+            return _mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\r')),
+                                 _mm_cmpeq_epi8(c, _mm_set1_epi8('\n'))));
+        }
+
+        // ASCII lowercase of all 16 bytes
+        inline __m128i lower16(__m128i c)
+        {
+            __m128i upper = _mm_and_si128(
+                    _mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+                    _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+            return _mm_add_epi8(c, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+        }
+#endif
+
+        //
+        // Header line tokenizing
+        //  lower_name copies a header name into out, lowercasing it, until
+        //  it reaches the ':' that ends the name or the end of the line.
+        //  It returns the offset of the ':', or npos if the line ended
+        //  first. Whole 16-byte blocks are lowercased and stored before
+        //  they are searched, so out must have room for n bytes.
+        //
+        inline size_t lower_name(char* out, const char* p, size_t n)
+        {
+            size_t i = 0;
+#if defined(__SSE2__)
+            for (; i + 16 <= n; i += 16)
             {
-                if (it != params.begin())
-                    ss << "&";
-                char* name = curl_easy_escape(NULL, it->first.c_str(), it->first.size());
-                char* value = curl_easy_escape(NULL, it->second.c_str(), it->second.size());
-                ss << name << "=" << value;
-                curl_free(name);
-                curl_free(value);
+                __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lower16(c));
+                unsigned stop = eol_mask16(c) |
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(':')));
+                if (stop)
+                {
+                    i += __builtin_ctz(stop);
+                    return p[i] == ':' ? i : std::string_view::npos;
+                }
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                char c = p[i];
+                if (c == ':')
+                    return i;
+                if (c == '\r' || c == '\n')
+                    break;
+                out[i] = lower(c);
             }
-            return ss.str();
+            return std::string_view::npos;
         }
 
-        std::string query(std::string const& url, httpparams const& params)
+        // Offset of the first CR or LF in p, or n if there is none
+        inline size_t find_eol(const char* p, size_t n)
         {
-            return url + "?" + serialize(params);
+            size_t i = 0;
+#if defined(__SSE2__)
+            for (; i + 16 <= n; i += 16)
+            {
+                unsigned mask = eol_mask16(
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+                if (mask)
+                    return i + __builtin_ctz(mask);
+            }
+#endif
+            for (; i < n; ++i)
+                if (p[i] == '\r' || p[i] == '\n')
+                    return i;
+            return n;
         }
 
+#if defined(HURL_AVX2_DISPATCH)
+        __attribute__((target("avx2")))
+        inline unsigned unreserved_mask32(const char* p)
+        {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+            __m256i alpha = _mm256_andnot_si256(
+                    _mm256_cmpgt_epi8(folded, _mm256_set1_epi8('z')),
+                    _mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)));
+            __m256i digit = _mm256_andnot_si256(
+                    _mm256_cmpgt_epi8(c, _mm256_set1_epi8('9')),
+                    _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)));
+            __m256i mark = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')),
+                                    _mm256_cmpeq_epi8(c, _mm256_set1_epi8('.'))),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')),
+                                    _mm256_cmpeq_epi8(c, _mm256_set1_epi8('~'))));
+            return _mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_or_si256(alpha, digit), mark));
+        }
 
-        void prepare_basic(handle&              curl,
-                           httpresponse &       resp,
-                           std::ostream &       out,
-                           std::string const&   url,
-                           int                  timeout,
-                           bool                 accept_compression = true)
+        inline bool detect_avx2()
         {
-            curl.reset();
-            curl.setopt(CURLOPT_URL, url.c_str());
-            curl.setopt(CURLOPT_NOSIGNAL, 1);
-            curl.setopt(CURLOPT_NOPROGRESS, 1);
-            curl.setopt(CURLOPT_WRITEFUNCTION, &streamfunc);
-            curl.setopt(CURLOPT_WRITEDATA, &out);
-            curl.setopt(CURLOPT_HEADERFUNCTION, &headerfunc);
-            curl.setopt(CURLOPT_HEADERDATA, &resp);
-            curl.setopt(CURLOPT_COOKIEFILE, ""); // turns on cookie engine
-            curl.setopt(CURLOPT_TIMEOUT, timeout);
+            // Runs during static initialization, so the CPU model must
+            // be initialized explicitly
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+        }
 
-            if (accept_compression)
-                curl.add_header("Accept-encoding: gzip");
+        static const bool have_avx2 = detect_avx2();
+#endif
+
+        // Number of bytes escape_into will write for the given input
+        inline size_t escaped_size_tail(const char* s, size_t n)
+        {
+            size_t size = n, i = 0;
+#if defined(__SSE2__)
+            for (; i + 16 <= n; i += 16)
+                size += 2 * (16 - __builtin_popcount(unreserved_mask16(s + i)));
+#endif
+            for (; i < n; ++i)
+                size += unreserved[(unsigned char)s[i]] ? 0 : 2;
+            return size;
         }
 
-        void prepare_post(handle&               curl,
-                          const void*           data,
-                          size_t                size,
-                          bool                  is_compressed = false)
+#if defined(HURL_AVX2_DISPATCH)
+        __attribute__((target("avx2")))
+        size_t escaped_size_avx2(const char* s, size_t n)
         {
-            curl.setopt(CURLOPT_POST, 1);
-            curl.setopt(CURLOPT_POSTFIELDS, data);
-            curl.setopt(CURLOPT_POSTFIELDSIZE, size);
+            size_t size = 0, i = 0;
+            for (; i + 32 <= n; i += 32)
+                size += 32 + 2 * (32 - __builtin_popcount(unreserved_mask32(s + i)));
+            return size + escaped_size_tail(s + i, n - i);
+        }
+#endif
 
-            // In keeping with hurl's "do the wrong thing easily"
-            // philosophy, disable "Expect: 100-continue" header
-            curl.add_header("Expect:");
+        size_t escaped_size(const char* s, size_t n)
+        {
+#if defined(HURL_AVX2_DISPATCH)
+            if (have_avx2)
+                return escaped_size_avx2(s, n);
+#endif
+            return escaped_size_tail(s, n);
+        }
 
-            // Include appropriate content-encoding with compressed POST data
-            if (is_compressed)
-                curl.add_header("Content-Encoding: gzip");
+        // Percent-encode n bytes from s into out, which must have room
+        // for escaped_size(s, n) bytes. Returns the new end of output.
+        //
+        // Blocks with nothing to encode are copied whole; otherwise the
+        // unreserved run up to the first byte needing encoding is copied
+        // and scanning resumes just past it.
+        inline char* escape_tail(char* out, const char* s, size_t n)
+        {
+            size_t i = 0;
+#if defined(__SSE2__)
+            while (i + 16 <= n)
+            {
+                unsigned mask = unreserved_mask16(s + i);
+                if (mask == 0xffff)
+                {
+                    std::memcpy(out, s + i, 16);
+                    out += 16;
+                    i += 16;
+                    continue;
+                }
+                unsigned run = __builtin_ctz(~mask);
+                std::memcpy(out, s + i, run);
+                out += run;
+                i += run;
+                unsigned char c = s[i++];
+                *out++ = '%';
+                *out++ = hexdigit(c >> 4);
+                *out++ = hexdigit(c);
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                unsigned char c = s[i];
+                if (unreserved[c])
+                {
+                    *out++ = c;
+                }
+                else
+                {
+                    *out++ = '%';
+                    *out++ = hexdigit(c >> 4);
+                    *out++ = hexdigit(c);
+                }
+            }
+            return out;
         }
 
-        void process_response(handle&           curl,
-                              httpresponse&     response)
+#if defined(HURL_AVX2_DISPATCH)
+        __attribute__((target("avx2")))
+        char* escape_avx2(char* out, const char* s, size_t n)
         {
-            if (response.headers.count("content-encoding"))
+            size_t i = 0;
+            while (i + 32 <= n)
             {
-                if (tolower(response.headers["content-encoding"]) == "gzip")
+                unsigned mask = unreserved_mask32(s + i);
+                if (mask == 0xffffffffu)
                 {
-                    response.body = gunzip(response.body);
+                    std::memcpy(out, s + i, 32);
+                    out += 32;
+                    i += 32;
+                    continue;
                 }
+                unsigned run = __builtin_ctz(~mask);
+                std::memcpy(out, s + i, run);
+                out += run;
+                i += run;
+                unsigned char c = s[i++];
+                *out++ = '%';
+                *out++ = hexdigit(c >> 4);
+                *out++ = hexdigit(c);
             }
+            return escape_tail(out, s + i, n - i);
         }
+#endif
 
-        httpresponse get(handle&                curl,
-                         std::string const&     url,
-                         int                    timeout)
+        char* escape_into(char* out, const char* s, size_t n)
         {
-            httpresponse result;
-            std::ostringstream ss;
-            prepare_basic(curl, result, ss, url, timeout);
-            curl.perform();
-            curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
-            // Copy the stream buffer into the response
-            result.body.assign(ss.str());
-            process_response(curl, result);
-            return result;
+#if defined(HURL_AVX2_DISPATCH)
+            if (have_avx2)
+                return escape_avx2(out, s, n);
+#endif
+            return escape_tail(out, s, n);
         }
 
-        httpresponse post(handle&               curl,
-                          std::string const&    url,
-                          std::string           data,
-                          int                   timeout)
+        // Decode %XX sequences from s into out, which must have room for
+        // n bytes. As with curl_easy_unescape, '+' is left alone and a
+        // '%' not followed by two hex digits is copied literally.
+        // Returns the new end of output.
+        char* unescape_into(char* out, const char* s, size_t n)
         {
-            httpresponse result;
-            std::ostringstream ss;
-            prepare_basic(curl, result, ss, url, timeout);
+            size_t i = 0;
+            while (i < n)
+            {
+#if defined(__SSE2__)
+                if (i + 16 <= n)
+                {
+                    unsigned mask = byte_mask16(s + i, '%');
+                    unsigned run = mask ? __builtin_ctz(mask) : 16;
+                    std::memcpy(out, s + i, run);
+                    out += run;
+                    i += run;
+                    if (!mask)
+                        continue;
+                }
+#endif
+                unsigned char c = s[i];
+                int hi, lo;
+                if (c == '%' && i + 2 < n
+                        && (hi = hexvalue(s[i+1])) >= 0
+                        && (lo = hexvalue(s[i+2])) >= 0)
+                {
+                    *out++ = static_cast<char>((hi << 4) | lo);
+                    i += 3;
+                }
+                else
+                {
+                    *out++ = c;
+                    i += 1;
+                }
+            }
+            return out;
+        }
 
-            // TEMP: apply gzip compression to request data over 10KB
-            bool compressed = false;
-            if (data.size() > 10240)
+        // Serialize HTTP params in a URL-encoded form appropriate for a
+        // query string or POST-fields request body, appending to out.
+        // The exact output size is computed up front so that out grows
+        // at most once and is encoded in place.
+        template<typename Params>
+        void serialize_into(std::string& out, Params const& params)
+        {
+            size_t size = 0;
+            for (typename Params::const_iterator it = params.begin();
+                    it != params.end(); ++it)
             {
-                data = gzip(data);
-                compressed = true;
+                if (it != params.begin())
+                    size += 1;
+                size += escaped_size(it->first.data(), it->first.size()) + 1;
+                size += escaped_size(it->second.data(), it->second.size());
             }
 
-            prepare_post(curl, data.data(), data.size(), compressed);
-            curl.perform();
-            curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
-            result.body.assign(ss.str());
-            process_response(curl, result);
-            return result;
+            size_t offset = out.size();
+            out.resize(offset + size);
+            char* dest = &out[0] + offset;
+            for (typename Params::const_iterator it = params.begin();
+                    it != params.end(); ++it)
+            {
+                if (it != params.begin())
+                    *dest++ = '&';
+                dest = escape_into(dest, it->first.data(), it->first.size());
+                *dest++ = '=';
+                dest = escape_into(dest, it->second.data(), it->second.size());
+            }
         }
 
-        httpresponse download(handle&           curl,
-                        std::string const&      url,
-                        std::string const&      localpath,
-                        int                     timeout)
+        template<typename Params>
+        std::string serialize(Params const& params)
         {
-            httpresponse result;
-            std::ofstream out(localpath.c_str(), std::ios::out |
-                                                 std::ios::binary |
-                                                 std::ios::trunc);
-            // NOTE: download currently doesn't allow compressed responses
-            prepare_basic(curl, result, out, url, timeout, false);
-            curl.perform();
-            curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
+            std::string result;
+            serialize_into(result, params);
             return result;
         }
-    }
 
-    namespace ext
-    {
-        void extract_tarball(std::string const& file, std::string const& extractdir)
+        template<typename Params>
+        std::string query(std::string const& url, Params const& params)
         {
-            TAR* t;
+            std::string result;
+            result.reserve(url.size() + 1);
+            result.append(url).append(1, '?');
+            serialize_into(result, params);
+            return result;
+        }
 
-            // libtar asks for a char*? Bad libtar! Bad! No biscuit.
-            if (tar_open(&t, const_cast<char*>(file.c_str()), NULL, O_RDONLY, 0777, TAR_GNU))
-                throw std::runtime_error("could not open tar");
+        // Explicit instantiations, for bench and other internal callers
+        template std::string serialize(httpparams const&);
+        template std::string serialize(httpparamlist const&);
 
-            if (tar_extract_all(t, const_cast<char*>(extractdir.c_str())))
-                throw std::runtime_error("could not extract tar");
 
-            tar_close(t);
-        }
     }
 
     //
-    // Implementations for the GET/POST free functions
+    // cache implementation
     //
-    httpresponse get(std::string const& url, int timeout)
+    namespace detail
     {
-        detail::handle curl;
-        return detail::get(curl, url, timeout);
-    }
+        // Value of the named header in a list of "Name: value" lines
+        std::string_view request_header(curl_slist const* list, std::string_view name)
+        {
+            for (; list; list = list->next)
+            {
+                std::string_view line(list->data);
+                size_t colon = line.find(':');
+                if (colon != std::string_view::npos && iequals(line.substr(0, colon), name))
+                    return trim(line.substr(colon + 1));
+            }
+            return std::string_view();
+        }
 
-    httpresponse get(std::string const& url, httpparams const& params, int timeout)
-    {
-        detail::handle curl;
-        return detail::get(curl, detail::query(url, params), timeout);
-    }
+        // Call f with each element of a comma-separated header list
+        template<typename F>
+        void split_list(std::string_view value, F f)
+        {
+            while (!value.empty())
+            {
+                size_t comma = value.find(',');
+                std::string_view item = trim(value.substr(0, comma));
+                if (!item.empty())
+                    f(item);
+                if (comma == std::string_view::npos)
+                    break;
+                value.remove_prefix(comma + 1);
+            }
+        }
 
-    httpresponse post(std::string const& url, std::string const& data, int timeout)
-    {
-        detail::handle curl;
-        return detail::post(curl, url, data, timeout);
-    }
+        // Parse delta-seconds, or return -1 if value isn't a number.
+        // Values too large to represent are capped, per RFC 9111 1.2.2.
+        long parse_seconds(std::string_view value)
+        {
+            if (value.empty())
+                return -1;
+            long result = 0;
+            for (size_t i = 0; i < value.size(); ++i)
+            {
+                if (value[i] < '0' || value[i] > '9')
+                    return -1;
+                result = std::min(result * 10 + (value[i] - '0'), 2147483648L);
+            }
+            return result;
+        }
 
-    httpresponse post(std::string const& url, httpparams const& params, int timeout)
-    {
-        detail::handle curl;
-        return detail::post(curl, url, detail::serialize(params), timeout);
-    }
+        // Parse an HTTP date, or return -1 if it can't be parsed
+        time_t parse_date(std::string_view value)
+        {
+            if (value.empty())
+                return -1;
+            return curl_getdate(std::string(value).c_str(), NULL);
+        }
 
-    httpresponse download(std::string const& url, std::string const& localpath, int timeout)
-    {
-        detail::handle curl;
-        return detail::download(curl, url, localpath, timeout);
-    }
+        struct cache_control
+        {
+            bool no_store;
+            bool no_cache;
+            long max_age;
+            long stale_while_revalidate;
+            long stale_if_error;
+        };
 
-    httpresponse downloadtarball(std::string const& url,
-                                 std::string const& localpath,
-                                 std::string const& extractdir,
-                                 int                timeout)
-    {
+        // The Cache-Control directives of a response that the cache acts
+        // on. Unknown directives are ignored.
+        cache_control parse_cache_control(httpheaders const& headers)
+        {
+            cache_control cc = { false, false, -1, 0, 0 };
+            for (std::string_view value : headers.values("cache-control"))
+            {
+                split_list(value, [&cc](std::string_view directive)
+                {
+                    size_t eq = directive.find('=');
+                    std::string_view name = trim(directive.substr(0, eq));
+                    std::string_view arg;
+                    if (eq != std::string_view::npos)
+                        arg = trim(directive.substr(eq + 1));
+                    if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"')
+                        arg = arg.substr(1, arg.size() - 2);
+
+                    if (iequals(name, "no-store"))
+                        cc.no_store = true;
+                    else if (iequals(name, "no-cache"))
+                        cc.no_cache = true;
+                    else if (iequals(name, "max-age"))
+                        cc.max_age = parse_seconds(arg);
+                    else if (iequals(name, "stale-while-revalidate"))
+                        cc.stale_while_revalidate = std::max(0L, parse_seconds(arg));
+                    else if (iequals(name, "stale-if-error"))
+                        cc.stale_if_error = std::max(0L, parse_seconds(arg));
+                });
+            }
+            return cc;
+        }
+
+        // Statuses that may be cached with a heuristic freshness lifetime
+        // (RFC 9110 15.1), less 206 since partial responses aren't stored
+        inline bool heuristically_cacheable(int status)
+        {
+            switch (status)
+            {
+            case 200: case 203: case 204: case 300: case 301: case 308:
+            case 404: case 405: case 410: case 414: case 501:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        struct cache_entry
+        {
+            std::string url;
+            httpresponse response;
+
+            // The request headers named by Vary, and their values in the
+            // request that produced this response
+            std::vector<std::pair<std::string,std::string>> vary;
+
+            time_t response_time;
+            long initial_age;       // corrected_initial_age (RFC 9111 4.2.3)
+            long lifetime;          // freshness_lifetime (RFC 9111 4.2.1)
+            bool no_cache;          // must be revalidated before every use
+            long stale_while_revalidate;    // RFC 5861 windows, in seconds
+            long stale_if_error;
+            size_t size;
+            std::string bodyname;   // name of the body file, for disk entries
+
+            long current_age(time_t now) const
+            {
+                return initial_age + std::max(0L, long(now - response_time));
+            }
+
+            bool fresh(time_t now) const
+            {
+                return !no_cache && current_age(now) < lifetime;
+            }
+
+            // Whether the entry may be served while it is refreshed
+            bool revalidating_usable(time_t now) const
+            {
+                return !no_cache && current_age(now) < lifetime + stale_while_revalidate;
+            }
+
+            // Whether the entry may be served in place of an error
+            bool error_usable(time_t now) const
+            {
+                return current_age(now) < lifetime + stale_if_error;
+            }
+
+            bool matches(curl_slist const* request) const
+            {
+                for (size_t i = 0; i < vary.size(); ++i)
+                    if (request_header(request, vary[i].first) != vary[i].second)
+                        return false;
+                return true;
+            }
+        };
+
+        // Combine a stored response with the headers of the 304 that
+        // validated it (RFC 9111 4.3.4). The stored Content-Length is
+        // kept, as it describes the stored body.
+        httpresponse freshen(httpresponse const& stored, httpresponse const& notmodified)
+        {
+            httpresponse result;
+            result.status = stored.status;
+            result.body = stored.body;
+            for (httpheaders::field f : stored.headers)
+                if (!notmodified.headers.count(f.first) || f.first == "content-length")
+                    result.headers.add(f.first, f.second);
+            for (httpheaders::field f : notmodified.headers)
+                if (f.first != "content-length")
+                    result.headers.add(f.first, f.second);
+            return result;
+        }
+
+        // Build a cache entry for a GET response, or return NULL if it
+        // must not or need not be stored
+        std::shared_ptr<cache_entry> make_entry(std::string const&  url,
+                                                curl_slist const*   request,
+                                                httpresponse const& response,
+                                                time_t              request_time,
+                                                time_t              response_time)
+        {
+            std::shared_ptr<cache_entry> entry;
+            if (response.status < 200 || response.status == 206 || response.status == 304)
+                return entry;
+
+            cache_control cc = parse_cache_control(response.headers);
+            if (cc.no_store)
+                return entry;
+
+            std::vector<std::pair<std::string,std::string>> vary;
+            bool vary_all = false;
+            for (std::string_view value : response.headers.values("vary"))
+            {
+                split_list(value, [&](std::string_view name)
+                {
+                    if (name == "*")
+                        vary_all = true;
+                    std::string lowered(name);
+                    std::transform(lowered.begin(), lowered.end(), lowered.begin(), lower);
+                    vary.push_back(std::make_pair(lowered,
+                                std::string(request_header(request, name))));
+                });
+            }
+            if (vary_all)
+                return entry;
+
+            time_t date = parse_date(response.header(h::date));
+            if (date == -1)
+                date = response_time;
+            long age = std::max(0L, parse_seconds(response.header(h::age)));
+            long apparent_age = std::max(0L, long(response_time - date));
+            long corrected_age = age + long(response_time - request_time);
+
+            long lifetime = 0;
+            if (cc.max_age >= 0)
+            {
+                lifetime = cc.max_age;
+            }
+            else if (!response.header(h::expires).empty())
+            {
+                // An invalid Expires means already expired
+                time_t expires = parse_date(response.header(h::expires));
+                lifetime = expires == -1 ? 0 : long(expires - date);
+            }
+            else if (heuristically_cacheable(response.status))
+            {
+                // 10% of the time since last modification, up to a day
+                time_t modified = parse_date(response.header(h::last_modified));
+                if (modified != -1)
+                    lifetime = std::min(long(date - modified) / 10, 86400L);
+            }
+
+            // A response that is already past serving stale, or that must
+            // always be revalidated, is only worth keeping if it can be
+            // revalidated
+            long initial_age = std::max(apparent_age, corrected_age);
+            bool validators = !response.header(h::etag).empty()
+                           || !response.header(h::last_modified).empty();
+            long usable = lifetime + std::max(cc.stale_while_revalidate, cc.stale_if_error);
+            if ((cc.no_cache || usable <= initial_age) && !validators)
+                return entry;
+
+            entry = std::make_shared<cache_entry>();
+            entry->url = url;
+            entry->response = response;
+            entry->vary.swap(vary);
+            entry->response_time = response_time;
+            entry->initial_age = initial_age;
+            entry->lifetime = lifetime;
+            entry->no_cache = cc.no_cache;
+            entry->stale_while_revalidate = cc.stale_while_revalidate;
+            entry->stale_if_error = cc.stale_if_error;
+            entry->size = sizeof(cache_entry) + url.size() + response.body.size();
+            for (httpheaders::field f : response.headers)
+                entry->size += f.first.size() + f.second.size() + 2 * sizeof(uint32_t);
+            return entry;
+        }
+
+        struct cache_shard
+        {
+            typedef std::list<std::shared_ptr<cache_entry const>> lru_list;
+
+            std::mutex lock;
+            lru_list lru;       // most recently used first
+            std::unordered_map<std::string_view, lru_list::iterator> index;
+            size_t bytes = 0;
+        };
+    }
+
+    class cache::impl
+    {
+    public:
+        impl(size_t maxbytes, unsigned shards)
+            : shards_(std::max(1u, shards)),
+              capacity_(maxbytes / shards_.size()),
+              hits_(0), misses_(0), stores_(0), evictions_(0), revalidations_(0), stale_(0)
+        {
+        }
+
+        std::shared_ptr<detail::cache_entry const> find(std::string const& url)
+        {
+            detail::cache_shard& shard = shard_for(url);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            auto it = shard.index.find(url);
+            if (it == shard.index.end())
+                return std::shared_ptr<detail::cache_entry const>();
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return *it->second;
+        }
+
+        void insert(std::shared_ptr<detail::cache_entry const> entry)
+        {
+            detail::cache_shard& shard = shard_for(entry->url);
+            if (entry->size > capacity_)
+                return;
+
+            std::lock_guard<std::mutex> guard(shard.lock);
+            erase(shard, entry->url);
+            shard.lru.push_front(entry);
+            shard.index[shard.lru.front()->url] = shard.lru.begin();
+            shard.bytes += entry->size;
+            ++stores_;
+
+            while (shard.bytes > capacity_)
+            {
+                erase(shard, shard.lru.back()->url);
+                ++evictions_;
+            }
+        }
+
+        void erase(std::string const& url)
+        {
+            detail::cache_shard& shard = shard_for(url);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            erase(shard, url);
+        }
+
+        void clear()
+        {
+            for (size_t i = 0; i < shards_.size(); ++i)
+            {
+                std::lock_guard<std::mutex> guard(shards_[i].lock);
+                shards_[i].index.clear();
+                shards_[i].lru.clear();
+                shards_[i].bytes = 0;
+            }
+        }
+
+        cachestats stats()
+        {
+            cachestats result = { hits_, misses_, stores_, evictions_, revalidations_, stale_,
+                                  0, 0 };
+            for (size_t i = 0; i < shards_.size(); ++i)
+            {
+                std::lock_guard<std::mutex> guard(shards_[i].lock);
+                result.entries += shards_[i].index.size();
+                result.bytes += shards_[i].bytes;
+            }
+            return result;
+        }
+
+        std::atomic<uint64_t>& hits() { return hits_; }
+        std::atomic<uint64_t>& misses() { return misses_; }
+        std::atomic<uint64_t>& revalidations() { return revalidations_; }
+        std::atomic<uint64_t>& stale() { return stale_; }
+
+    private:
+        detail::cache_shard& shard_for(std::string_view url)
+        {
+            return shards_[std::hash<std::string_view>()(url) % shards_.size()];
+        }
+
+        // Caller must hold the shard lock
+        void erase(detail::cache_shard& shard, std::string_view url)
+        {
+            auto it = shard.index.find(url);
+            if (it == shard.index.end())
+                return;
+            detail::cache_shard::lru_list::iterator entry = it->second;
+            shard.bytes -= (*entry)->size;
+            shard.index.erase(it);
+            shard.lru.erase(entry);
+        }
+
+        std::vector<detail::cache_shard> shards_;
+        size_t capacity_;
+        std::atomic<uint64_t> hits_;
+        std::atomic<uint64_t> misses_;
+        std::atomic<uint64_t> stores_;
+        std::atomic<uint64_t> evictions_;
+        std::atomic<uint64_t> revalidations_;
+        std::atomic<uint64_t> stale_;
+    };
+
+    cache::cache(size_t maxbytes, unsigned shards)
+        : impl_(new impl(maxbytes, shards))
+    {
+    }
+
+    cache::~cache()
+    {
+        // Out of line for the same reason as client::~client
+    }
+
+    cachestats cache::stats() const
+    {
+        return impl_->stats();
+    }
+
+    void cache::clear()
+    {
+        impl_->clear();
+    }
+
+    //
+    // diskcache implementation
+    //
+    namespace detail
+    {
+        // A read-only memory mapping of a whole file
+        class mapping
+        {
+        public:
+            explicit mapping(std::string const& path)
+                : data_(NULL), size_(0), ok_(false)
+            {
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    return;
+                struct stat st;
+                if (fstat(fd, &st) == 0)
+                {
+                    size_ = st.st_size;
+                    if (size_ == 0)
+                    {
+                        ok_ = true;
+                    }
+                    else
+                    {
+                        void* p = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+                        if (p != MAP_FAILED)
+                        {
+                            data_ = static_cast<char const*>(p);
+                            ok_ = true;
+                        }
+                    }
+                }
+                close(fd);
+            }
+
+            ~mapping()
+            {
+                if (data_)
+                    munmap(const_cast<char*>(data_), size_);
+            }
+
+            bool ok() const
+            {
+                return ok_;
+            }
+
+            std::string_view view() const
+            {
+                return std::string_view(data_, size_);
+            }
+
+        private:
+            char const* data_;
+            size_t size_;
+            bool ok_;
+
+            // Noncopyable
+            mapping(mapping const&);
+            mapping& operator=(mapping const&);
+        };
+
+        bool write_all(int fd, char const* data, size_t size)
+        {
+            while (size)
+            {
+                ssize_t n = write(fd, data, size);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        std::string hex(uint64_t value, int digits)
+        {
+            std::string result(digits, '0');
+            for (int i = digits - 1; i >= 0; --i, value >>= 4)
+                result[i] = "0123456789abcdef"[value & 0xf];
+            return result;
+        }
+
+        uint64_t fnv1a(std::string_view s)
+        {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (size_t i = 0; i < s.size(); ++i)
+                hash = (hash ^ (unsigned char)s[i]) * 0x100000001b3ull;
+            return hash;
+        }
+
+        // SHA-256 (FIPS 180-4) of a body, which names the body's file
+        class content_name
+        {
+        public:
+            content_name() : size_(0), used_(0)
+            {
+                static const uint32_t initial[8] = {
+                    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+                };
+                std::copy(initial, initial + 8, state_);
+            }
+
+            void update(char const* data, size_t size)
+            {
+                size_ += size;
+                while (size)
+                {
+                    size_t chunk = std::min(size, sizeof(block_) - used_);
+                    std::memcpy(block_ + used_, data, chunk);
+                    used_ += chunk;
+                    data += chunk;
+                    size -= chunk;
+                    if (used_ == sizeof(block_))
+                    {
+                        compress();
+                        used_ = 0;
+                    }
+                }
+            }
+
+            std::string str() const
+            {
+                content_name last(*this);
+                uint64_t bits = size_ * 8;
+                last.block_[last.used_++] = 0x80;
+                if (last.used_ > 56)
+                {
+                    std::memset(last.block_ + last.used_, 0, 64 - last.used_);
+                    last.compress();
+                    last.used_ = 0;
+                }
+                std::memset(last.block_ + last.used_, 0, 56 - last.used_);
+                for (int i = 0; i < 8; ++i)
+                    last.block_[63 - i] = static_cast<unsigned char>(bits >> (8 * i));
+                last.compress();
+
+                std::string result;
+                for (int i = 0; i < 8; ++i)
+                    result += hex(last.state_[i], 8);
+                return result;
+            }
+
+        private:
+            static uint32_t rotr(uint32_t x, int n)
+            {
+                return (x >> n) | (x << (32 - n));
+            }
+
+            void compress()
+            {
+                static const uint32_t k[64] = {
+                    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+                    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+                    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+                    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+                    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+                    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+                    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+                    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+                    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+                };
+
+                uint32_t w[64];
+                for (int i = 0; i < 16; ++i)
+                    w[i] = uint32_t(block_[4 * i]) << 24 | uint32_t(block_[4 * i + 1]) << 16
+                         | uint32_t(block_[4 * i + 2]) << 8 | uint32_t(block_[4 * i + 3]);
+                for (int i = 16; i < 64; ++i)
+                {
+                    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                }
+
+                uint32_t v[8];
+                std::copy(state_, state_ + 8, v);
+                for (int i = 0; i < 64; ++i)
+                {
+                    uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+                    uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+                    uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+                    uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+                    uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+                    std::copy_backward(v, v + 7, v + 8);
+                    v[4] += t1;
+                    v[0] = t1 + s0 + maj;
+                }
+                for (int i = 0; i < 8; ++i)
+                    state_[i] += v[i];
+            }
+
+            uint32_t state_[8];
+            uint64_t size_;
+            size_t used_;
+            unsigned char block_[64];
+        };
+
+        template<typename F>
+        void for_each_file(std::string const& dir, F f)
+        {
+            DIR* d = opendir(dir.c_str());
+            if (!d)
+                return;
+            while (dirent* e = readdir(d))
+            {
+                if (e->d_name[0] != '.')
+                    f(std::string(e->d_name));
+            }
+            closedir(d);
+        }
+
+        void make_directory(std::string const& path)
+        {
+            if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+                throw std::runtime_error("could not create " + path);
+        }
+
+        //
+        // Index files
+        //  Each cached URL has an index file, named by a hash of the URL,
+        //  holding one field per line:
+        //
+        //      hurl-cache 1
+        //      url <url>
+        //      status <status>
+        //      time <response time> <initial age> <lifetime> <no-cache>
+        //      stale <stale-while-revalidate> <stale-if-error>
+        //      body <body file name>
+        //      vary <name> <value>         (any number)
+        //      header <name> <value>       (any number)
+        //
+        std::string format_index(cache_entry const& entry, std::string const& bodyname)
+        {
+            std::ostringstream out;
+            out << "hurl-cache 1\n"
+                << "url " << entry.url << "\n"
+                << "status " << entry.response.status << "\n"
+                << "time " << entry.response_time << " " << entry.initial_age << " "
+                << entry.lifetime << " " << (entry.no_cache ? 1 : 0) << "\n"
+                << "stale " << entry.stale_while_revalidate << " " << entry.stale_if_error << "\n"
+                << "body " << bodyname << "\n";
+            for (size_t i = 0; i < entry.vary.size(); ++i)
+                out << "vary " << entry.vary[i].first << " " << entry.vary[i].second << "\n";
+            for (httpheaders::field f : entry.response.headers)
+                out << "header " << f.first << " " << f.second << "\n";
+            return out.str();
+        }
+
+        // Parse an index file, or return NULL if it is malformed
+        std::shared_ptr<cache_entry> parse_index(std::string_view text)
+        {
+            std::shared_ptr<cache_entry> entry = std::make_shared<cache_entry>();
+            entry->stale_while_revalidate = 0;
+            entry->stale_if_error = 0;
+            bool valid = false;
+            while (!text.empty())
+            {
+                size_t eol = text.find('\n');
+                if (eol == std::string_view::npos)
+                    return std::shared_ptr<cache_entry>();
+                std::string_view line = text.substr(0, eol);
+                text.remove_prefix(eol + 1);
+
+                size_t space = line.find(' ');
+                std::string_view key = line.substr(0, space);
+                std::string_view rest =
+                    space == std::string_view::npos ? "" : line.substr(space + 1);
+                size_t split = rest.find(' ');
+                std::string_view name = rest.substr(0, split);
+                std::string_view value =
+                    split == std::string_view::npos ? "" : rest.substr(split + 1);
+
+                if (key == "hurl-cache")
+                {
+                    valid = rest == "1";
+                }
+                else if (key == "url")
+                {
+                    entry->url = rest;
+                }
+                else if (key == "status")
+                {
+                    entry->response.status = std::atoi(std::string(rest).c_str());
+                }
+                else if (key == "time")
+                {
+                    std::istringstream in{std::string(rest)};
+                    int no_cache = 0;
+                    in >> entry->response_time >> entry->initial_age >> entry->lifetime >> no_cache;
+                    entry->no_cache = no_cache != 0;
+                    valid = valid && !in.fail();
+                }
+                else if (key == "stale")
+                {
+                    std::istringstream in{std::string(rest)};
+                    in >> entry->stale_while_revalidate >> entry->stale_if_error;
+                }
+                else if (key == "body")
+                {
+                    entry->bodyname = rest;
+                }
+                else if (key == "vary")
+                {
+                    entry->vary.push_back(std::make_pair(std::string(name), std::string(value)));
+                }
+                else if (key == "header")
+                {
+                    entry->response.headers.add(name, value);
+                }
+            }
+            if (!valid || entry->url.empty() || entry->bodyname.empty())
+                entry.reset();
+            return entry;
+        }
+    }
+
+    class diskcache::impl
+    {
+    public:
+        impl(std::string const& directory, uint64_t maxbytes)
+            : dir_(directory), capacity_(maxbytes), sequence_(0), temp_sequence_(0),
+              hits_(0), misses_(0), stores_(0), evictions_(0), revalidations_(0), stale_(0)
+        {
+            detail::make_directory(dir_);
+            detail::make_directory(dir_ + "/index");
+            detail::make_directory(dir_ + "/data");
+            detail::make_directory(dir_ + "/tmp");
+        }
+
+        // The stored entry for a URL, without its body
+        std::shared_ptr<detail::cache_entry> find(std::string const& url)
+        {
+            std::string path = index_path(url);
+            std::ifstream in(path.c_str(), std::ios::binary);
+            std::ostringstream text;
+            text << in.rdbuf();
+            std::shared_ptr<detail::cache_entry> entry = detail::parse_index(text.str());
+            if (!entry || entry->url != url)
+                return std::shared_ptr<detail::cache_entry>();
+
+            struct stat st;
+            if (stat(body_path(entry->bodyname).c_str(), &st) != 0)
+                return std::shared_ptr<detail::cache_entry>();
+
+            // The index file's modification time orders entries for eviction
+            utimes(path.c_str(), NULL);
+            return entry;
+        }
+
+        bool load_body(std::string const& bodyname, std::string& body)
+        {
+            detail::mapping map(body_path(bodyname));
+            if (!map.ok())
+                return false;
+            body.assign(map.view());
+            return true;
+        }
+
+        bool copy_body(std::string const& bodyname, std::string const& dest)
+        {
+            detail::mapping map(body_path(bodyname));
+            if (!map.ok())
+                return false;
+            int fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return false;
+            bool ok = detail::write_all(fd, map.view().data(), map.view().size());
+            return close(fd) == 0 && ok;
+        }
+
+        // Store a body and return its name, or an empty string if it
+        // couldn't be stored
+        std::string put_body(std::string_view body)
+        {
+            detail::content_name name;
+            name.update(body.data(), body.size());
+            std::string tmp = temp_path();
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (fd < 0)
+                return std::string();
+            bool ok = detail::write_all(fd, body.data(), body.size());
+            ok = close(fd) == 0 && ok;
+            return install_body(tmp, name.str(), ok);
+        }
+
+        // As put_body, copying the body from a file
+        std::string put_body_file(std::string const& path)
+        {
+            int in = open(path.c_str(), O_RDONLY);
+            if (in < 0)
+                return std::string();
+            std::string tmp = temp_path();
+            int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (out < 0)
+            {
+                close(in);
+                return std::string();
+            }
+
+            detail::content_name name;
+            std::vector<char> buf(1 << 16);
+            bool ok = true;
+            ssize_t n;
+            while (ok && (n = read(in, &buf.front(), buf.size())) != 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                ok = n > 0 && detail::write_all(out, &buf.front(), n);
+                if (ok)
+                    name.update(&buf.front(), n);
+            }
+            close(in);
+            ok = close(out) == 0 && ok;
+            return install_body(tmp, name.str(), ok);
+        }
+
+        void put_index(detail::cache_entry const& entry, std::string const& bodyname)
+        {
+            std::string text = detail::format_index(entry, bodyname);
+            std::string tmp = temp_path();
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (fd < 0)
+                return;
+            bool ok = detail::write_all(fd, text.data(), text.size());
+            ok = close(fd) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), index_path(entry.url).c_str()) != 0)
+            {
+                unlink(tmp.c_str());
+                return;
+            }
+            ++stores_;
+            if (++sequence_ % sweep_interval == 0 || sweep_due())
+                sweep();
+        }
+
+        void erase(std::string const& url)
+        {
+            unlink(index_path(url).c_str());
+        }
+
+        void clear()
+        {
+            static const char* subdirs[] = { "/index/", "/data/", "/tmp/" };
+            for (size_t i = 0; i < 3; ++i)
+            {
+                std::string dir = dir_ + subdirs[i];
+                detail::for_each_file(dir, [&dir](std::string const& name)
+                {
+                    unlink((dir + name).c_str());
+                });
+            }
+        }
+
+        cachestats stats()
+        {
+            cachestats result = { hits_, misses_, stores_, evictions_, revalidations_, stale_,
+                                  0, 0 };
+            std::string index = dir_ + "/index/";
+            std::string data = dir_ + "/data/";
+            detail::for_each_file(index, [&](std::string const& name)
+            {
+                struct stat st;
+                if (stat((index + name).c_str(), &st) == 0)
+                {
+                    ++result.entries;
+                    result.bytes += st.st_size;
+                }
+            });
+            detail::for_each_file(data, [&](std::string const& name)
+            {
+                struct stat st;
+                if (stat((data + name).c_str(), &st) == 0)
+                    result.bytes += st.st_size;
+            });
+            return result;
+        }
+
+        std::atomic<uint64_t>& hits() { return hits_; }
+        std::atomic<uint64_t>& misses() { return misses_; }
+        std::atomic<uint64_t>& revalidations() { return revalidations_; }
+        std::atomic<uint64_t>& stale() { return stale_; }
+
+    private:
+        // Stores between attempts to trim the directory
+        static const unsigned sweep_interval = 64;
+
+        // Bodies and temporary files written or reused more recently than
+        // this are never swept, as their index entry may still be on its
+        // way
+        static const time_t grace_period = 60;
+
+        // Whether no process has swept the directory for a while
+        bool sweep_due() const
+        {
+            struct stat st;
+            return stat((dir_ + "/lock").c_str(), &st) != 0
+                || st.st_mtime < time(NULL) - grace_period;
+        }
+
+        std::string index_path(std::string const& url) const
+        {
+            return dir_ + "/index/" + detail::hex(detail::fnv1a(url), 16);
+        }
+
+        std::string body_path(std::string const& bodyname) const
+        {
+            return dir_ + "/data/" + bodyname;
+        }
+
+        std::string temp_path()
+        {
+            return dir_ + "/tmp/" + detail::hex(getpid(), 8) + "."
+                 + detail::hex(++temp_sequence_, 16);
+        }
+
+        // Move a completed temporary body into place under its content
+        // name. If a body of that name exists it is kept, and its
+        // modification time renewed so that a sweep which read the index
+        // before this entry's was written leaves it alone.
+        std::string install_body(std::string const& tmp, std::string const& name, bool ok)
+        {
+            std::string path = body_path(name);
+            if (ok && utimes(path.c_str(), NULL) == 0)
+            {
+                unlink(tmp.c_str());
+                return name;
+            }
+            if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+            {
+                unlink(tmp.c_str());
+                return std::string();
+            }
+            return name;
+        }
+
+        //
+        // sweep
+        //  Trim the directory to capacity, keeping the most recently used
+        //  index entries and the bodies they refer to. Only one process
+        //  sweeps at a time; others skip their turn. The lock file's
+        //  modification time records the last sweep. An entry whose body a
+        //  sweep removes regardless is found as a miss.
+        //
+        void sweep()
+        {
+            int lock = open((dir_ + "/lock").c_str(), O_RDWR | O_CREAT, 0600);
+            if (lock < 0)
+                return;
+            if (flock(lock, LOCK_EX | LOCK_NB) != 0)
+            {
+                close(lock);
+                return;
+            }
+
+            struct indexfile
+            {
+                std::string path;
+                std::string bodyname;
+                time_t used;
+                uint64_t size;
+            };
+
+            std::string index = dir_ + "/index/";
+            std::string data = dir_ + "/data/";
+            std::string tmp = dir_ + "/tmp/";
+
+            std::vector<indexfile> entries;
+            detail::for_each_file(index, [&](std::string const& name)
+            {
+                indexfile f = { index + name, std::string(), 0, 0 };
+                struct stat st;
+                if (stat(f.path.c_str(), &st) != 0)
+                    return;
+                f.used = st.st_mtime;
+                f.size = st.st_size;
+                std::ifstream in(f.path.c_str());
+                std::string line;
+                while (std::getline(in, line))
+                    if (line.compare(0, 5, "body ") == 0)
+                        f.bodyname = line.substr(5);
+                entries.push_back(f);
+            });
+            std::sort(entries.begin(), entries.end(),
+                      [](indexfile const& a, indexfile const& b) { return a.used > b.used; });
+
+            std::unordered_map<std::string, uint64_t> bodies;
+            detail::for_each_file(data, [&](std::string const& name)
+            {
+                struct stat st;
+                if (stat((data + name).c_str(), &st) == 0)
+                    bodies[name] = st.st_size;
+            });
+
+            // Keep entries, most recently used first, while they fit
+            std::unordered_map<std::string, bool> kept;
+            uint64_t total = 0;
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                uint64_t size = entries[i].size;
+                if (!kept.count(entries[i].bodyname) && bodies.count(entries[i].bodyname))
+                    size += bodies[entries[i].bodyname];
+                if (total + size > capacity_)
+                {
+                    unlink(entries[i].path.c_str());
+                    ++evictions_;
+                    continue;
+                }
+                total += size;
+                kept[entries[i].bodyname] = true;
+            }
+
+            time_t cutoff = time(NULL) - grace_period;
+            detail::for_each_file(data, [&](std::string const& name)
+            {
+                struct stat st;
+                std::string path = data + name;
+                if (!kept.count(name) && stat(path.c_str(), &st) == 0 && st.st_mtime < cutoff)
+                    unlink(path.c_str());
+            });
+            detail::for_each_file(tmp, [&](std::string const& name)
+            {
+                struct stat st;
+                std::string path = tmp + name;
+                if (stat(path.c_str(), &st) == 0 && st.st_mtime < cutoff)
+                    unlink(path.c_str());
+            });
+
+            futimes(lock, NULL);
+            flock(lock, LOCK_UN);
+            close(lock);
+        }
+
+        std::string dir_;
+        uint64_t capacity_;
+        std::atomic<uint64_t> sequence_;
+        std::atomic<uint64_t> temp_sequence_;
+        std::atomic<uint64_t> hits_;
+        std::atomic<uint64_t> misses_;
+        std::atomic<uint64_t> stores_;
+        std::atomic<uint64_t> evictions_;
+        std::atomic<uint64_t> revalidations_;
+        std::atomic<uint64_t> stale_;
+    };
+
+    diskcache::diskcache(std::string const& directory, uint64_t maxbytes)
+        : impl_(new impl(directory, maxbytes))
+    {
+    }
+
+    diskcache::~diskcache()
+    {
+        // Out of line for the same reason as client::~client
+    }
+
+    cachestats diskcache::stats() const
+    {
+        return impl_->stats();
+    }
+
+    void diskcache::clear()
+    {
+        impl_->clear();
+    }
+
+    namespace detail
+    {
+        // The caches used by the free functions; read and written with
+        // the atomic shared_ptr operations
+        std::shared_ptr<cache> default_cache;
+        std::shared_ptr<diskcache> default_diskcache;
+
+        // Whether the free functions coalesce identical GETs
+        std::atomic<bool> coalescing(false);
+
+        // The caches a request consults, in memory first and then on disk
+        struct caches
+        {
+            std::shared_ptr<cache> memory;
+            std::shared_ptr<diskcache> disk;
+        };
+
+        caches default_caches()
+        {
+            caches result = { std::atomic_load(&default_cache),
+                              std::atomic_load(&default_diskcache) };
+            return result;
+        }
+
+        struct cache_access
+        {
+            // Find the stored response for a request, fresh or not, and
+            // whether it came from disk. Each cache consulted counts a hit
+            // if its response can be used as is, otherwise a miss. A fresh
+            // response found on disk is copied into memory.
+            static std::shared_ptr<cache_entry const> lookup(caches const&      store,
+                                                             std::string const& url,
+                                                             handle const&      curl,
+                                                             bool&              on_disk)
+            {
+                time_t now = time(NULL);
+                std::shared_ptr<cache_entry const> entry;
+                on_disk = false;
+                if (store.memory)
+                {
+                    cache::impl& c = *store.memory->impl_;
+                    entry = c.find(url);
+                    if (entry && !entry->matches(curl.headers()))
+                        entry.reset();
+                    if (entry && entry->fresh(now))
+                    {
+                        ++c.hits();
+                        return entry;
+                    }
+                    ++c.misses();
+                }
+
+                std::shared_ptr<cache_entry> found = find_file(store, url, curl);
+                if (found && store.disk->impl_->load_body(found->bodyname, found->response.body))
+                {
+                    found->size = sizeof(cache_entry) + url.size() + found->response.body.size();
+                    if (found->fresh(now) && store.memory)
+                        store.memory->impl_->insert(found);
+                    on_disk = true;
+                    return found;
+                }
+                return entry;
+            }
+
+            // Find the disk cache's entry for a download, without its body
+            static std::shared_ptr<cache_entry> find_file(caches const&       store,
+                                                          std::string const&  url,
+                                                          handle const&       curl)
+            {
+                if (!store.disk)
+                    return std::shared_ptr<cache_entry>();
+                diskcache::impl& c = *store.disk->impl_;
+                std::shared_ptr<cache_entry> entry = c.find(url);
+                if (entry && !entry->matches(curl.headers()))
+                    entry.reset();
+                if (entry && entry->fresh(time(NULL)))
+                    ++c.hits();
+                else
+                    ++c.misses();
+                return entry;
+            }
+
+            // Write the body of a disk cache entry to a file
+            static bool copy_file(caches const&         store,
+                                  cache_entry const&    entry,
+                                  std::string const&    dest)
+            {
+                return store.disk && store.disk->impl_->copy_body(entry.bodyname, dest);
+            }
+
+            // Store a response in each cache. A response whose body is
+            // already on disk under bodyname isn't written again.
+            static void store(caches const&         store,
+                              std::string const&    url,
+                              handle const&         curl,
+                              httpresponse const&   response,
+                              time_t                request_time,
+                              std::string const&    bodyname = std::string())
+            {
+                if (!store.memory && !store.disk)
+                    return;
+                std::shared_ptr<cache_entry> entry = make_entry(
+                        url, curl.headers(), response, request_time, time(NULL));
+                if (!entry)
+                    return;
+                if (store.memory)
+                    store.memory->impl_->insert(entry);
+                if (store.disk)
+                {
+                    diskcache::impl& c = *store.disk->impl_;
+                    std::string name = bodyname.empty() ? c.put_body(response.body) : bodyname;
+                    if (!name.empty())
+                        c.put_index(*entry, name);
+                }
+            }
+
+            // Store a downloaded response, whose body is in a file, on disk
+            static void store_file(caches const&        store,
+                                   std::string const&   url,
+                                   handle const&        curl,
+                                   httpresponse const&  response,
+                                   time_t               request_time,
+                                   std::string const&   path)
+            {
+                if (!store.disk)
+                    return;
+                std::shared_ptr<cache_entry> entry = make_entry(
+                        url, curl.headers(), response, request_time, time(NULL));
+                if (!entry)
+                    return;
+                diskcache::impl& c = *store.disk->impl_;
+                std::string name = c.put_body_file(path);
+                if (!name.empty())
+                    c.put_index(*entry, name);
+            }
+
+            // Store a response freshened by a 304, in place of the stored
+            // entry it was made from, counted against the cache that
+            // returned it. An entry copied into memory from disk keeps its
+            // body name, but that body is only known to be in this disk
+            // cache if the entry came from it.
+            static void revalidated(caches const&       store,
+                                    std::string const&  url,
+                                    handle const&       curl,
+                                    cache_entry const&  stored,
+                                    bool                on_disk,
+                                    httpresponse const& response,
+                                    time_t              request_time)
+            {
+                if (on_disk && store.disk)
+                    ++store.disk->impl_->revalidations();
+                else if (store.memory)
+                    ++store.memory->impl_->revalidations();
+                cache_access::store(store, url, curl, response, request_time,
+                                    on_disk ? stored.bodyname : std::string());
+            }
+
+            // Count a stale entry being served
+            static void served_stale(caches const& store, bool on_disk)
+            {
+                if (on_disk && store.disk)
+                    ++store.disk->impl_->stale();
+                else if (store.memory)
+                    ++store.memory->impl_->stale();
+            }
+
+            static void invalidate(caches const& store, std::string const& url)
+            {
+                if (store.memory)
+                    store.memory->impl_->erase(url);
+                if (store.disk)
+                    store.disk->impl_->erase(url);
+            }
+        };
+    }
+
+    void setcache(std::shared_ptr<cache> c)
+    {
+        std::atomic_store(&detail::default_cache, c);
+    }
+
+    void setdiskcache(std::shared_ptr<diskcache> c)
+    {
+        std::atomic_store(&detail::default_diskcache, c);
+    }
+
+    void setcoalescing(bool enabled)
+    {
+        detail::coalescing = enabled;
+    }
+
+
+    //
+    // retry implementation
+    //
+    retrypolicy::retrypolicy()
+        : attempts(1), backoff_ms(100), multiplier(2.0), max_backoff_ms(10000),
+          jitter(true), retry_after(true), retry_post(false),
+          budget_ratio(0.2), budget_burst(10)
+    {
+    }
+
+    breakerpolicy::breakerpolicy()
+        : enabled(false), failures(5), error_rate(0.5), window(20),
+          open_ms(5000), trials(1)
+    {
+    }
+
+    circuit_open::circuit_open(std::string const& host)
+        : std::runtime_error("circuit open for " + host)
+    {
+    }
+
+    httpoptions::httpoptions()
+        : timeout(0), timeout_ms(0), connect_timeout_ms(0),
+          first_byte_timeout_ms(0), low_speed_limit(0), low_speed_time(0)
+    {
+    }
+
+    deadline::deadline()
+        : when_(), set_(false)
+    {
+    }
+
+    deadline::deadline(clock::time_point when)
+        : when_(when), set_(true)
+    {
+    }
+
+    deadline deadline::after(long ms)
+    {
+        return deadline(clock::now() + std::chrono::milliseconds(ms));
+    }
+
+    deadline::operator bool() const
+    {
+        return set_;
+    }
+
+    bool deadline::passed() const
+    {
+        return set_ && clock::now() >= when_;
+    }
+
+    long deadline::remaining_ms() const
+    {
+        clock::duration left = when_ - clock::now();
+        if (left <= clock::duration::zero())
+            return 0;
+        return long(std::chrono::duration_cast<std::chrono::milliseconds>(left).count());
+    }
+
+    deadline::clock::time_point deadline::when() const
+    {
+        return when_;
+    }
+
+    namespace detail
+    {
+        // The time limits for a transfer, in milliseconds; 0 for none
+        struct limits
+        {
+            long timeout;
+            long connect;
+            long first_byte;
+            long low_speed_limit;   // bytes per second ...
+            long low_speed_time;    // ... over this many seconds
+            deadline until;         // applied as each transfer starts
+        };
+
+        // The limits set by options, with the timeout in seconds and the
+        // deadline used when options sets none. Throws deadline_exceeded
+        // if the deadline has already passed, so no work is done for it.
+        limits make_limits(httpoptions const& options, int timeout, deadline const& until)
+        {
+            limits result;
+            result.until = options.deadline ? options.deadline : until;
+            if (result.until && result.until.remaining_ms() <= 0)
+                throw deadline_exceeded();
+            if (options.timeout_ms > 0)
+                result.timeout = options.timeout_ms;
+            else
+                result.timeout = 1000L * (options.timeout ? options.timeout : timeout);
+            result.connect = options.connect_timeout_ms;
+            result.first_byte = options.first_byte_timeout_ms;
+            result.low_speed_limit = options.low_speed_limit;
+            result.low_speed_time = options.low_speed_time;
+            return result;
+        }
+
+        limits make_limits(httpoptions const& options)
+        {
+            return make_limits(options, 0, deadline());
+        }
+
+        // The time a transfer may take at most, as of now; 0 for no limit
+        long time_left(limits const& limit)
+        {
+            if (!limit.until)
+                return limit.timeout;
+            long left = std::max(1L, limit.until.remaining_ms());
+            return limit.timeout > 0 ? std::min(limit.timeout, left) : left;
+        }
+
+        struct counters
+        {
+            std::atomic<uint64_t> attempts;
+            std::atomic<uint64_t> retries;
+            std::atomic<uint64_t> exhausted;
+            std::atomic<uint64_t> over_budget;
+            std::atomic<uint64_t> hedges;
+            std::atomic<uint64_t> hedges_won;
+            std::atomic<uint64_t> opened;
+            std::atomic<uint64_t> rejected;
+            std::atomic<uint64_t> compressed;
+            std::atomic<uint64_t> compression_skipped;
+        };
+        counters totals = {};
+
+        // Background refreshes may use the counters during static
+        // destruction, which leaves them alone
+        static_assert(std::is_trivially_destructible<counters>::value,
+                      "counters must outlive background refreshes");
+
+        //
+        // retrybudget
+        //  A token bucket limiting retries to a share of requests. It starts
+        //  full, so that an occasional failure can always be retried.
+        //
+        class retrybudget
+        {
+        public:
+            retrybudget()
+                : tokens_(-1)
+            {
+            }
+
+            void deposit(retrypolicy const& policy)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (tokens_ < 0)
+                    tokens_ = policy.budget_burst;
+                tokens_ = std::min(policy.budget_burst, tokens_ + policy.budget_ratio);
+            }
+
+            bool withdraw()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (tokens_ < 1)
+                    return false;
+                tokens_ -= 1;
+                return true;
+            }
+
+        private:
+            std::mutex mutex_;
+            double tokens_;
+        };
+
+        // The retry policy for a request and the budget it draws on
+        struct retrying
+        {
+            retrypolicy policy;
+            std::shared_ptr<retrybudget> budget;
+        };
+
+        // The policy and budget used by the free functions
+        std::shared_ptr<retrypolicy const> default_retry;
+        std::shared_ptr<retrybudget> default_budget = std::make_shared<retrybudget>();
+
+        retrying default_retrying(std::optional<retrypolicy> const& given)
+        {
+            retrying result;
+            if (given)
+            {
+                result.policy = *given;
+            }
+            else
+            {
+                std::shared_ptr<retrypolicy const> policy = std::atomic_load(&default_retry);
+                if (policy)
+                    result.policy = *policy;
+            }
+            result.budget = default_budget;
+            return result;
+        }
+
+        // The host and port of a URL, lowercased, as a key for per-host
+        // state
+        std::string host_of(std::string const& url)
+        {
+            size_t begin = url.find("://");
+            begin = begin == std::string::npos ? 0 : begin + 3;
+            size_t end = url.find_first_of("/?#", begin);
+            if (end == std::string::npos)
+                end = url.size();
+            size_t at = url.rfind('@', end);
+            if (at != std::string::npos && at >= begin)
+                begin = at + 1;
+            std::string host = url.substr(begin, end - begin);
+            std::transform(host.begin(), host.end(), host.begin(), lower);
+            return host;
+        }
+
+        //
+        // circuits
+        //  Per-host circuit breakers, shared by every request in the
+        //  process. A host's circuit opens after a run of failures, or a
+        //  high share of failures among recent requests; while open,
+        //  requests to it fail at once with circuit_open. Once open_ms has
+        //  passed, a few trial requests are let through, and the circuit
+        //  closes if one succeeds and opens again if one fails.
+        //
+        class circuits
+        {
+        public:
+            // Admit a request to a host, or throw circuit_open. Returns
+            // whether the request is a trial, to be passed to record.
+            bool admit(std::string const& host, breakerpolicy const& policy)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                circuit& c = hosts_[host];
+                if (c.mode == circuit::open &&
+                    std::chrono::steady_clock::now() >= c.until)
+                {
+                    c.mode = circuit::half_open;
+                    c.trials = 0;
+                }
+                if (c.mode == circuit::closed)
+                    return false;
+                if (c.mode == circuit::half_open && c.trials < policy.trials)
+                {
+                    ++c.trials;
+                    return true;
+                }
+                ++totals.rejected;
+                throw circuit_open(host);
+            }
+
+            void record(std::string const&      host,
+                        breakerpolicy const&    policy,
+                        bool                    trial,
+                        bool                    failed)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                circuit& c = hosts_[host];
+                if (trial)
+                {
+                    if (failed)
+                        open(c, policy);
+                    else
+                        c = circuit();
+                    return;
+                }
+                if (c.mode != circuit::closed)
+                    return;
+
+                c.consecutive = failed ? c.consecutive + 1 : 0;
+                if (c.outcomes.size() < size_t(policy.window))
+                {
+                    c.outcomes.push_back(failed);
+                }
+                else
+                {
+                    c.failures -= c.outcomes[c.next];
+                    c.outcomes[c.next] = failed;
+                    c.next = (c.next + 1) % c.outcomes.size();
+                }
+                c.failures += failed;
+
+                bool full = c.outcomes.size() >= size_t(policy.window);
+                if (c.consecutive >= policy.failures ||
+                    (full && c.failures >= policy.error_rate * c.outcomes.size()))
+                    open(c, policy);
+            }
+
+            // End a request that says nothing about the host either way,
+            // giving back its trial if it was one
+            void release(std::string const& host, bool trial)
+            {
+                if (!trial)
+                    return;
+                std::lock_guard<std::mutex> lock(mutex_);
+                circuit& c = hosts_[host];
+                if (c.mode == circuit::half_open && c.trials > 0)
+                    --c.trials;
+            }
+
+        private:
+            struct circuit
+            {
+                circuit()
+                    : mode(closed), consecutive(0), next(0), failures(0), trials(0)
+                {
+                }
+
+                enum { closed, open, half_open } mode;
+                int consecutive;                // failures in a row
+                std::vector<char> outcomes;     // recent requests, true if failed
+                size_t next;                    // oldest outcome, once full
+                size_t failures;                // failures among outcomes
+                std::chrono::steady_clock::time_point until;
+                int trials;                     // trial requests let through
+            };
+
+            void open(circuit& c, breakerpolicy const& policy)
+            {
+                c = circuit();
+                c.mode = circuit::open;
+                c.until = std::chrono::steady_clock::now()
+                        + std::chrono::milliseconds(policy.open_ms);
+                ++totals.opened;
+            }
+
+            std::mutex mutex_;
+            std::unordered_map<std::string, circuit> hosts_;
+        };
+
+        circuits& all_circuits()
+        {
+            // Never destroyed, as background refreshes may outlive it
+            static circuits& instance = *new circuits;
+            return instance;
+        }
+
+        std::shared_ptr<breakerpolicy const>& default_breaker()
+        {
+            // Never destroyed, as background refreshes may outlive it
+            static std::shared_ptr<breakerpolicy const>& instance =
+                *new std::shared_ptr<breakerpolicy const>;
+            return instance;
+        }
+
+        // Whether a transfer failed because the server dropped the
+        // connection, after the request may have been sent
+        bool dropped(curl_error const& e)
+        {
+            return e.code() == CURLE_GOT_NOTHING ||
+                   e.code() == CURLE_RECV_ERROR ||
+                   e.code() == CURLE_SEND_ERROR ||
+                   e.code() == CURLE_PARTIAL_FILE;
+        }
+
+        bool retryable_status(int status, bool idempotent)
+        {
+            switch (status)
+            {
+            case 429:
+                return true;
+            case 408: case 502: case 503: case 504:
+                return idempotent;
+            default:
+                return false;
+            }
+        }
+
+        // The wait asked for by a Retry-After header, in milliseconds, or
+        // -1 if there is none
+        long retry_after(httpresponse const& response)
+        {
+            std::string_view value = response.header(h::retry_after);
+            if (value.empty())
+                return -1;
+            long seconds = parse_seconds(value);
+            if (seconds < 0)
+            {
+                time_t date = parse_date(value);
+                if (date == -1)
+                    return -1;
+                seconds = std::max(0L, long(date - time(NULL)));
+            }
+            return seconds * 1000;
+        }
+
+        // The wait before the given retry, in milliseconds
+        long backoff(retrypolicy const& policy, int retry)
+        {
+            double delay = policy.backoff_ms;
+            for (int i = 1; i < retry && delay < policy.max_backoff_ms; ++i)
+                delay *= policy.multiplier;
+            delay = std::min<double>(delay, policy.max_backoff_ms);
+            if (policy.jitter)
+            {
+                thread_local std::mt19937 random(std::random_device{}());
+                delay = std::uniform_real_distribution<double>(0, delay)(random);
+            }
+            return long(delay);
+        }
+
+        //
+        // with_retries
+        //  Make a transfer, which sets the response status, retrying it as
+        //  the policy allows. rewind is called before each retry to discard
+        //  what the failed attempt wrote. The request itself, body included,
+        //  is left as the caller set it up and sent again.
+        //
+        template<typename Transfer, typename Rewind>
+        void with_retries(std::string const&    url,
+                          httpresponse&         result,
+                          retrying const&       retry,
+                          deadline const&       until,
+                          bool                  idempotent,
+                          Transfer              transfer,
+                          Rewind                rewind)
+        {
+            retrypolicy const& policy = retry.policy;
+            if (retry.budget)
+                retry.budget->deposit(policy);
+            idempotent = idempotent || policy.retry_post;
+
+            std::shared_ptr<breakerpolicy const> breaker = std::atomic_load(&default_breaker());
+            if (breaker && !breaker->enabled)
+                breaker.reset();
+            std::string host = breaker ? host_of(url) : std::string();
+
+            for (int attempt = 1; ; ++attempt)
+            {
+                long wait = backoff(policy, attempt);
+                bool trial = breaker && all_circuits().admit(host, *breaker);
+                ++totals.attempts;
+                std::exception_ptr failure;
+                bool retryable = false;
+                bool judged = true;     // whether the outcome says anything of the host
+                bool failed = true;     // whether it counts against the host
+                try
+                {
+                    transfer();
+                    failed = result.status >= 500;
+                    retryable = retryable_status(result.status, idempotent);
+                    long asked = -1;
+                    if (policy.retry_after && (result.status == 429 || result.status == 503))
+                        asked = retry_after(result);
+                    if (asked > policy.max_backoff_ms)
+                        retryable = false;
+                    else if (asked >= 0)
+                        wait = asked;
+                }
+                catch (deadline_exceeded const&)
+                {
+                    // The caller's time ran out, not necessarily the host's
+                    failure = std::current_exception();
+                    judged = false;
+                }
+                catch (connect_error const&)
+                {
+                    failure = std::current_exception();
+                    retryable = true;
+                }
+                catch (resolve_error const&)
+                {
+                    failure = std::current_exception();
+                    retryable = true;
+                }
+                catch (hurl::timeout const&)
+                {
+                    failure = std::current_exception();
+                    retryable = idempotent;
+                }
+                catch (curl_error const& e)
+                {
+                    failure = std::current_exception();
+                    retryable = idempotent && dropped(e);
+                    failed = dropped(e);
+                }
+                catch (...)
+                {
+                    // Not the transfer's doing, e.g. a body callback threw
+                    if (breaker)
+                        all_circuits().release(host, trial);
+                    throw;
+                }
+                if (breaker && judged)
+                    all_circuits().record(host, *breaker, trial, failed);
+                else if (breaker)
+                    all_circuits().release(host, trial);
+
+                if (retryable && attempt >= policy.attempts)
+                {
+                    if (policy.attempts > 1)
+                        ++totals.exhausted;
+                    retryable = false;
+                }
+                if (retryable && until && wait >= until.remaining_ms())
+                    retryable = false;
+                if (retryable && retry.budget && !retry.budget->withdraw())
+                {
+                    ++totals.over_budget;
+                    retryable = false;
+                }
+                if (!retryable)
+                {
+                    if (failure)
+                        std::rethrow_exception(failure);
+                    return;
+                }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+                result.headers.clear();
+                rewind();
+                ++totals.retries;
+            }
+        }
+
+        // Perform a prepared transfer on one handle, with retries
+        template<typename Rewind>
+        void perform(handle&            curl,
+                     std::string const& url,
+                     httpresponse&      result,
+                     retrying const&    retry,
+                     deadline const&    until,
+                     bool               idempotent,
+                     Rewind             rewind)
+        {
+            with_retries(url, result, retry, until, idempotent, [&curl, &result]()
+            {
+                curl.perform();
+                curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
+            }, rewind);
+        }
+    }
+
+    void setbreaker(breakerpolicy const& policy)
+    {
+        std::atomic_store(&detail::default_breaker(),
+                          std::shared_ptr<breakerpolicy const>(new breakerpolicy(policy)));
+    }
+
+    void setretry(retrypolicy const& policy)
+    {
+        std::atomic_store(&detail::default_retry,
+                          std::shared_ptr<retrypolicy const>(new retrypolicy(policy)));
+    }
+
+    //
+    // hedging implementation
+    //
+    hedgepolicy::hedgepolicy()
+        : enabled(false), delay_ms(100), percentile(95)
+    {
+    }
+
+    namespace detail
+    {
+        //
+        // latencies
+        //  Recent GET latencies to each host, from which hedging delays
+        //  are taken.
+        //
+        class latencies
+        {
+        public:
+            void add(std::string const& host, long ms)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                window& w = hosts_[host];
+                if (w.samples.size() < window_size)
+                    w.samples.push_back(ms);
+                else
+                    w.samples[w.next] = ms;
+                w.next = (w.next + 1) % window_size;
+            }
+
+            // The given percentile of recent latencies to a host, or -1
+            // if too few have been seen
+            long percentile(std::string const& host, double p)
+            {
+                std::vector<long> samples;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    std::unordered_map<std::string, window>::iterator it = hosts_.find(host);
+                    if (it == hosts_.end() || it->second.samples.size() < min_samples)
+                        return -1;
+                    samples = it->second.samples;
+                }
+                size_t rank = std::min(samples.size() - 1, size_t(samples.size() * p / 100));
+                std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+                return samples[rank];
+            }
+
+        private:
+            static const size_t window_size = 256;
+            static const size_t min_samples = 20;
+
+            struct window
+            {
+                window() : next(0) { }
+                std::vector<long> samples;
+                size_t next;
+            };
+
+            std::mutex mutex_;
+            std::unordered_map<std::string, window> hosts_;
+        };
+
+        latencies& recent_latencies()
+        {
+            // Never destroyed, as background refreshes may outlive it
+            static latencies& instance = *new latencies;
+            return instance;
+        }
+
+        std::shared_ptr<hedgepolicy const> default_hedge;
+
+        hedgepolicy default_hedging(std::optional<hedgepolicy> const& given)
+        {
+            if (given)
+                return *given;
+            std::shared_ptr<hedgepolicy const> policy = std::atomic_load(&default_hedge);
+            return policy ? *policy : hedgepolicy();
+        }
+
+        long elapsed_ms(std::chrono::steady_clock::time_point since)
+        {
+            return long(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - since).count());
+        }
+
+        //
+        // perform_hedged
+        //  Perform a prepared GET, and if it hasn't completed within delay
+        //  milliseconds, start an identical one on a duplicate handle. The
+        //  first to complete successfully provides the response and the
+        //  other is abandoned; if both fail, the first's error is thrown.
+        //  The duplicate writes to its own response and stream, which are
+        //  moved into result and out if it wins.
+        //
+        void perform_hedged(handle&             curl,
+                            httpresponse&       result,
+                            std::ostringstream& out,
+                            long                delay)
+        {
+            std::unique_ptr<CURLM, CURLMcode (*)(CURLM*)> multi(curl_multi_init(),
+                                                                &curl_multi_cleanup);
+            if (!multi)
+                throw std::runtime_error("curl_multi_init failed");
+
+            httpresponse second_result;
+            std::ostringstream second_out;
+            std::unique_ptr<handle> second;
+
+            curl.ready();
+            curl_multi_add_handle(multi.get(), curl.get());
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            int first_code = -1, second_code = -1;
+            handle* winner = NULL;
+            try
+            {
+            while (!winner)
+            {
+                int running = 0;
+                curl_multi_perform(multi.get(), &running);
+
+                int queued = 0;
+                while (CURLMsg* msg = curl_multi_info_read(multi.get(), &queued))
+                {
+                    if (msg->msg != CURLMSG_DONE)
+                        continue;
+                    if (msg->easy_handle == curl.get())
+                        first_code = msg->data.result;
+                    else
+                        second_code = msg->data.result;
+                }
+
+                if (first_code == CURLE_OK)
+                    winner = &curl;
+                else if (second_code == CURLE_OK)
+                    winner = second.get();
+                else if (first_code != -1 && (!second || second_code != -1))
+                    curl.check(first_code);
+                if (winner)
+                    break;
+
+                // Start the hedge once the delay is up
+                long remaining = 1000;
+                if (!second)
+                {
+                    remaining = delay - elapsed_ms(start);
+                    if (remaining <= 0)
+                    {
+                        second = curl.duplicate();
+                        second->setopt(CURLOPT_WRITEDATA, &second_out);
+                        second->setopt(CURLOPT_HEADERDATA, &second_result);
+                        second->ready();
+                        curl_multi_add_handle(multi.get(), second->get());
+                        ++totals.hedges;
+                        continue;
+                    }
+                }
+                curl_multi_poll(multi.get(), NULL, 0, int(remaining), NULL);
+            }
+            }
+            catch (...)
+            {
+                curl_multi_remove_handle(multi.get(), curl.get());
+                if (second)
+                    curl_multi_remove_handle(multi.get(), second->get());
+                throw;
+            }
+
+            if (winner == second.get())
+            {
+                ++totals.hedges_won;
+                result = std::move(second_result);
+                out.str(second_out.str());
+            }
+            winner->getinfo(CURLINFO_RESPONSE_CODE, &result.status);
+
+            curl_multi_remove_handle(multi.get(), curl.get());
+            if (second)
+                curl_multi_remove_handle(multi.get(), second->get());
+        }
+
+        //
+        // perform_get
+        //  Perform a prepared GET, hedged if the policy says so, recording
+        //  its latency for later hedging delays.
+        //
+        void perform_get(handle&                curl,
+                         httpresponse&          result,
+                         std::ostringstream&    out,
+                         std::string const&     url,
+                         hedgepolicy const&     hedge)
+        {
+            if (!hedge.enabled)
+            {
+                curl.perform();
+                curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
+                return;
+            }
+
+            std::string host = host_of(url);
+            long delay = hedge.delay_ms;
+            if (hedge.percentile > 0)
+            {
+                long observed = recent_latencies().percentile(host, hedge.percentile);
+                if (observed >= 0)
+                    delay = observed;
+            }
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            perform_hedged(curl, result, out, delay);
+            recent_latencies().add(host, elapsed_ms(start));
+        }
+    }
+
+    void sethedge(hedgepolicy const& policy)
+    {
+        std::atomic_store(&detail::default_hedge,
+                          std::shared_ptr<hedgepolicy const>(new hedgepolicy(policy)));
+    }
+
+    httpstats stats()
+    {
+        httpstats result = {
+            detail::totals.attempts,
+            detail::totals.retries,
+            detail::totals.exhausted,
+            detail::totals.over_budget,
+            detail::totals.hedges,
+            detail::totals.hedges_won,
+            detail::totals.opened,
+            detail::totals.rejected,
+            detail::totals.compressed,
+            detail::totals.compression_skipped
+        };
+        return result;
+    }
+
+
+    //
+    // Dictionaries
+    //
+    class dictionary::impl
+    {
+    public:
+        explicit impl(std::string const& content)
+            : content_(content), id_(0)
+#if defined(HURL_WITH_ZSTD)
+            , ddict_(NULL)
+#endif
+        {
+            // A zstd dictionary starts with a magic number and its id, both
+            // little-endian; anything else is raw content, with no id
+            unsigned char const* p = (unsigned char const*)content_.data();
+            if (content_.size() >= 8 && p[0] == 0x37 && p[1] == 0xa4 &&
+                    p[2] == 0x30 && p[3] == 0xec)
+                id_ = uint32_t(p[4]) | uint32_t(p[5]) << 8 |
+                      uint32_t(p[6]) << 16 | uint32_t(p[7]) << 24;
+        }
+
+        ~impl()
+        {
+#if defined(HURL_WITH_ZSTD)
+            for (auto& level : cdicts_)
+                ZSTD_freeCDict(level.second);
+            ZSTD_freeDDict(ddict_);
+#endif
+        }
+
+        std::string const& content() const
+        {
+            return content_;
+        }
+
+        uint32_t id() const
+        {
+            return id_;
+        }
+
+#if defined(HURL_WITH_ZSTD)
+        // Digested forms, made on first use; a CDict is fixed to a level
+        ZSTD_CDict const* cdict(int level)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ZSTD_CDict*& cdict = cdicts_[level];
+            if (cdict == NULL)
+                cdict = ZSTD_createCDict(content_.data(), content_.size(), level);
+            if (cdict == NULL)
+                throw std::runtime_error("error loading zstd dictionary");
+            return cdict;
+        }
+
+        ZSTD_DDict const* ddict()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (ddict_ == NULL)
+                ddict_ = ZSTD_createDDict(content_.data(), content_.size());
+            if (ddict_ == NULL)
+                throw std::runtime_error("error loading zstd dictionary");
+            return ddict_;
+        }
+#endif
+
+    private:
+        std::string content_;
+        uint32_t id_;
+#if defined(HURL_WITH_ZSTD)
+        std::mutex mutex_;
+        std::map<int, ZSTD_CDict*> cdicts_;
+        ZSTD_DDict* ddict_;
+#endif
+    };
+
+    dictionary::dictionary()
+    { }
+
+    dictionary::dictionary(std::string const& content)
+        : impl_(std::make_shared<impl>(content))
+    { }
+
+    // Out of line, like client::~client; inlined into the optional in
+    // httpoptions, these trip GCC's -Wmaybe-uninitialized
+    dictionary::dictionary(dictionary const& other) = default;
+    dictionary& dictionary::operator=(dictionary const& other) = default;
+    dictionary::~dictionary() = default;
+
+    dictionary dictionary::train(std::vector<std::string> const& samples,
+                                 size_t capacity)
+    {
+#if defined(HURL_WITH_ZSTD)
+        std::string joined;
+        std::vector<size_t> sizes;
+        sizes.reserve(samples.size());
+        for (auto const& sample : samples)
+        {
+            joined += sample;
+            sizes.push_back(sample.size());
+        }
+        std::string content(capacity, '\0');
+        size_t size = ZDICT_trainFromBuffer(&content[0], content.size(),
+                                            joined.data(), sizes.data(),
+                                            unsigned(sizes.size()));
+        if (ZDICT_isError(size))
+            throw std::runtime_error(std::string("failed to train dictionary: ") +
+                                     ZDICT_getErrorName(size));
+        content.resize(size);
+        return dictionary(content);
+#else
+        (void)samples;
+        (void)capacity;
+        throw std::runtime_error("hurl built without zstd");
+#endif
+    }
+
+    dictionary::operator bool() const
+    {
+        return bool(impl_);
+    }
+
+    std::string const& dictionary::content() const
+    {
+        static const std::string empty;
+        return impl_ ? impl_->content() : empty;
+    }
+
+    uint32_t dictionary::id() const
+    {
+        return impl_ ? impl_->id() : 0;
+    }
+
+    namespace detail
+    {
+        struct dictionary_access
+        {
+            static dictionary::impl& get(dictionary const& dict)
+            {
+                return *dict.impl_;
+            }
+        };
+
+        // Dictionaries for decoding responses, by id
+        struct dictionary_registry
+        {
+            std::mutex mutex;
+            std::unordered_map<uint32_t, dictionary> ids;
+        };
+
+        dictionary_registry& dictionaries()
+        {
+            // Never destroyed, as background refreshes may outlive it
+            static dictionary_registry& instance = *new dictionary_registry;
+            return instance;
+        }
+
+        dictionary find_dictionary(uint32_t id)
+        {
+            dictionary_registry& registry = dictionaries();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            auto it = registry.ids.find(id);
+            return it == registry.ids.end() ? dictionary() : it->second;
+        }
+
+        std::string unzstd(std::string const& input)
+        {
+#if defined(HURL_WITH_ZSTD)
+            ZSTD_DDict const* ddict = NULL;
+            dictionary dict;
+            if (unsigned id = ZSTD_getDictID_fromFrame(input.data(), input.size()))
+            {
+                dict = find_dictionary(id);
+                if (!dict)
+                    throw std::runtime_error("response compressed with an unknown zstd dictionary");
+                ddict = dictionary_access::get(dict).ddict();
+            }
+
+            std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)>
+                context(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+            if (!context)
+                throw std::runtime_error("error initializing zstd");
+            if (ddict)
+                ZSTD_DCtx_refDDict(context.get(), ddict);
+
+            // Frames normally record their size; don't trust a huge one
+            std::string result;
+            unsigned long long known = ZSTD_getFrameContentSize(input.data(), input.size());
+            if (known < (1ull << 30))
+                result.reserve(size_t(known));
+
+            ZSTD_inBuffer in = { input.data(), input.size(), 0 };
+            std::vector<char> buffer(ZSTD_DStreamOutSize());
+            size_t left = 0;
+            while (in.pos < in.size)
+            {
+                ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+                left = ZSTD_decompressStream(context.get(), &out, &in);
+                if (ZSTD_isError(left))
+                    throw std::runtime_error(ZSTD_getErrorName(left));
+                result.append(buffer.data(), out.pos);
+            }
+            // Flush what's left of the last frame
+            while (left != 0)
+            {
+                ZSTD_outBuffer out = { buffer.data(), buffer.size(), 0 };
+                left = ZSTD_decompressStream(context.get(), &out, &in);
+                if (ZSTD_isError(left))
+                    throw std::runtime_error(ZSTD_getErrorName(left));
+                if (out.pos == 0)
+                    throw std::runtime_error("failed to completely decompress");
+                result.append(buffer.data(), out.pos);
+            }
+            return result;
+#else
+            (void)input;
+            throw std::runtime_error("hurl built without zstd");
+#endif
+        }
+    }
+
+    void adddictionary(dictionary const& dict)
+    {
+#if defined(HURL_WITH_ZSTD)
+        if (dict.id() == 0)
+            throw std::invalid_argument("not a zstd dictionary");
+        detail::dictionary_registry& registry = detail::dictionaries();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.ids[dict.id()] = dict;
+#else
+        (void)dict;
+        throw std::runtime_error("hurl built without zstd");
+#endif
+    }
+
+    namespace detail
+    {
+        void prepare_basic(handle&              curl,
+                           httpresponse &       resp,
+                           std::ostream &       out,
+                           std::string const&   url,
+                           limits const&        limit,
+                           bool                 accept_compression = true)
+        {
+            curl.reset();
+            curl.setopt(CURLOPT_URL, url.c_str());
+            curl.setopt(CURLOPT_NOSIGNAL, 1);
+            curl.setopt(CURLOPT_NOPROGRESS, 1);
+            curl.setopt(CURLOPT_WRITEFUNCTION, &streamfunc);
+            curl.setopt(CURLOPT_WRITEDATA, &out);
+            curl.setopt(CURLOPT_HEADERFUNCTION, &headerfunc);
+            curl.setopt(CURLOPT_HEADERDATA, &resp);
+            resp.headers.reserve(1024);
+            curl.setopt(CURLOPT_COOKIEFILE, ""); // turns on cookie engine
+            curl.setopt(CURLOPT_TIMEOUT_MS, limit.timeout);
+            curl.setopt(CURLOPT_CONNECTTIMEOUT_MS, limit.connect);
+            if (limit.low_speed_limit > 0 && limit.low_speed_time > 0)
+            {
+                curl.setopt(CURLOPT_LOW_SPEED_LIMIT, limit.low_speed_limit);
+                curl.setopt(CURLOPT_LOW_SPEED_TIME, limit.low_speed_time);
+            }
+            curl.limit_first_byte(limit.first_byte);
+            curl.limit_deadline(limit.until, limit.timeout);
+
+            if (accept_compression)
+            {
+#if defined(HURL_WITH_ZSTD)
+                curl.add_header("Accept-encoding: gzip, zstd");
+#else
+                curl.add_header("Accept-encoding: gzip");
+#endif
+            }
+        }
+
+        void process_response(httpresponse&     response)
+        {
+            std::string_view encoding = response.header(h::content_encoding);
+            if (iequals(encoding, "gzip"))
+            {
+                response.body = gunzip(response.body);
+            }
+            else if (iequals(encoding, "zstd"))
+            {
+                response.body = unzstd(response.body);
+            }
+        }
+
+        // Make the request conditional on the stored response having
+        // changed, given its validators
+        void add_validators(handle& curl, httpresponse const& stored)
+        {
+            std::string_view etag = stored.header(h::etag);
+            if (!etag.empty())
+                curl.add_header("If-None-Match: " + std::string(etag));
+            std::string_view modified = stored.header(h::last_modified);
+            if (!modified.empty())
+                curl.add_header("If-Modified-Since: " + std::string(modified));
+        }
+
+        //
+        // Single-flight GETs
+        //  Identical GETs made at the same time share one transfer: the
+        //  first caller performs it and the others wait for its response,
+        //  or its exception. Requests are identical if they have the same
+        //  URL and request headers, which covers any header a response
+        //  might Vary on.
+        //
+        //  A leader that times out, as by its own deadline, says nothing
+        //  of the others' limits: they start a new flight instead, within
+        //  the time they have left.
+        //
+        class flights
+        {
+        public:
+            template<typename F>
+            httpresponse run(std::string const& key, limits const& limit, F fetch)
+            {
+                long timeout_ms = time_left(limit);
+                std::chrono::steady_clock::time_point give_up =
+                    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+                std::unique_lock<std::mutex> lock(mutex_);
+                for (;;)
+                {
+                    std::unordered_map<std::string, std::shared_future<httpresponse>>::iterator
+                        it = inflight_.find(key);
+                    if (it == inflight_.end())
+                        break;
+
+                    std::shared_future<httpresponse> shared = it->second;
+                    lock.unlock();
+                    if (timeout_ms > 0 &&
+                        shared.wait_until(give_up) == std::future_status::timeout)
+                    {
+                        if (limit.until.passed())
+                            throw deadline_exceeded();
+                        throw hurl::timeout();
+                    }
+                    try
+                    {
+                        return shared.get();
+                    }
+                    catch (abandoned const&)
+                    {
+                    }
+                    lock.lock();
+                }
+
+                std::promise<httpresponse> promise;
+                inflight_[key] = promise.get_future().share();
+                lock.unlock();
+                try
+                {
+                    httpresponse result = fetch();
+                    land(key);
+                    promise.set_value(result);
+                    return result;
+                }
+                catch (hurl::timeout const&)
+                {
+                    land(key);
+                    promise.set_exception(std::make_exception_ptr(abandoned()));
+                    throw;
+                }
+                catch (...)
+                {
+                    land(key);
+                    promise.set_exception(std::current_exception());
+                    throw;
+                }
+            }
+
+            static std::string key(std::string const& url, curl_slist const* headers)
+            {
+                std::string result = url;
+                for (; headers; headers = headers->next)
+                {
+                    result += '\n';
+                    result += headers->data;
+                }
+                return result;
+            }
+
+        private:
+            // Given to waiting callers when the leader timed out
+            struct abandoned {};
+
+            void land(std::string const& key)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                inflight_.erase(key);
+            }
+
+            std::mutex mutex_;
+            std::unordered_map<std::string, std::shared_future<httpresponse>> inflight_;
+        };
+
+        // The flights shared by the free functions, when coalescing is on
+        flights default_flights;
+
+        void refresh(std::string const& url, limits const& limit, caches const& store,
+                     retrying const& retry);
+
+        //
+        // fetch
+        //  Perform a GET that the caches could not answer, revalidating the
+        //  stored response if there is one, or serving it in place of an
+        //  error where that is allowed.
+        //
+        httpresponse fetch(handle&                              curl,
+                           httpresponse&                        result,
+                           std::ostringstream&                  ss,
+                           std::string const&                   url,
+                           limits const&                        limit,
+                           caches const&                        store,
+                           retrying const&                      retry,
+                           hedgepolicy const&                   hedge,
+                           std::shared_ptr<cache_entry const>   stored,
+                           bool                                 on_disk)
+        {
+            if (stored)
+                add_validators(curl, stored->response);
+
+            // Whether the stored response may stand in for a failed request
+            bool stale_on_error = false;
+
+            time_t request_time = time(NULL);
+            try
+            {
+                with_retries(url, result, retry, limit.until, true, [&]()
+                {
+                    perform_get(curl, result, ss, url, hedge);
+                }, [&ss]()
+                {
+                    ss.str(std::string());
+                });
+            }
+            catch (connect_error const&)
+            {
+                stale_on_error = stored && stored->error_usable(time(NULL));
+                if (!stale_on_error)
+                    throw;
+            }
+            catch (circuit_open const&)
+            {
+                stale_on_error = stored && stored->error_usable(time(NULL));
+                if (!stale_on_error)
+                    throw;
+            }
+            catch (hurl::timeout const&)
+            {
+                stale_on_error = stored && stored->error_usable(time(NULL));
+                if (!stale_on_error)
+                    throw;
+            }
+            catch (curl_error const& e)
+            {
+                // The server went away mid-transfer
+                stale_on_error = stored && stored->error_usable(time(NULL)) && dropped(e);
+                if (!stale_on_error)
+                    throw;
+            }
+            if (!stale_on_error)
+            {
+                stale_on_error = result.status >= 500 && stored
+                              && stored->error_usable(time(NULL));
+            }
+            if (stale_on_error)
+            {
+                cache_access::served_stale(store, on_disk);
+                return stored->response;
+            }
+
+            if (stored && result.status == 304)
+            {
+                result = freshen(stored->response, result);
+                cache_access::revalidated(store, url, curl, *stored, on_disk, result,
+                                          request_time);
+                return result;
+            }
+
+            // Copy the stream buffer into the response
+            result.body.assign(ss.str());
+            process_response(result);
+            cache_access::store(store, url, curl, result, request_time);
+            return result;
+        }
+
+        httpresponse get(handle&                curl,
+                         std::string const&     url,
+                         limits const&          limit,
+                         caches const&          store = caches(),
+                         retrying const&        retry = retrying(),
+                         hedgepolicy const&     hedge = hedgepolicy(),
+                         flights*               group = NULL,
+                         bool                   allow_stale = true)
+        {
+            httpresponse result;
+            std::ostringstream ss;
+            prepare_basic(curl, result, ss, url, limit);
+
+            bool on_disk;
+            std::shared_ptr<cache_entry const> stored =
+                cache_access::lookup(store, url, curl, on_disk);
+            time_t now = time(NULL);
+            if (stored && stored->fresh(now))
+                return stored->response;
+            if (stored && allow_stale && stored->revalidating_usable(now))
+            {
+                refresh(url, limit, store, retry);
+                cache_access::served_stale(store, on_disk);
+                return stored->response;
+            }
+
+            if (group)
+            {
+                // Join an identical request in flight, or lead one with
+                // what the caches already returned
+                std::string key = flights::key(url, curl.headers());
+                return group->run(key, limit, [&]()
+                {
+                    return fetch(curl, result, ss, url, limit, store, retry, hedge,
+                                 stored, on_disk);
+                });
+            }
+            return fetch(curl, result, ss, url, limit, store, retry, hedge, stored, on_disk);
+        }
+
+        //
+        // refresh
+        //  Fetch a fresh copy of a stale cached response in the background,
+        //  unless one is already being fetched for the same caches. The
+        //  thread holds its own references to the caches, so they stay
+        //  alive until it is done. It is not bound by the deadline of the
+        //  request that started it. At most max_refreshes run at once;
+        //  past that, the stale response is served without one, and a
+        //  later request starts it.
+        //
+        struct refreshes
+        {
+            std::mutex mutex;
+            std::unordered_set<std::string> keys;
+        };
+
+        const size_t max_refreshes = 16;
+
+        refreshes& running_refreshes()
+        {
+            // Never destroyed, as refreshes may outlive static destruction
+            static refreshes& instance = *new refreshes;
+            return instance;
+        }
+
+        bool refreshing()
+        {
+            refreshes& running = running_refreshes();
+            std::lock_guard<std::mutex> lock(running.mutex);
+            return !running.keys.empty();
+        }
+
+        // Names a refresh by the caches it fills and the URL. The thread
+        // keeps the caches alive, so their addresses aren't reused.
+        std::string refresh_key(std::string const& url, caches const& store)
+        {
+            return hex(reinterpret_cast<uintptr_t>(store.memory.get()), 16) +
+                   hex(reinterpret_cast<uintptr_t>(store.disk.get()), 16) + url;
+        }
+
+        void refresh(std::string const& url, limits const& limit, caches const& store,
+                     retrying const& retry)
+        {
+            refreshes& running = running_refreshes();
+            std::string key = refresh_key(url, store);
+            {
+                std::lock_guard<std::mutex> lock(running.mutex);
+                if (running.keys.size() >= max_refreshes || !running.keys.insert(key).second)
+                    return;
+            }
+            limits background = limit;
+            background.until = deadline();
+            try
+            {
+                std::thread([url, key, background, store, retry]()
+                {
+                    try
+                    {
+                        handle curl;
+                        get(curl, url, background, store, retry, hedgepolicy(), NULL, false);
+                    }
+                    catch (...)
+                    {
+                        // The stale entry is kept for later requests to retry
+                    }
+                    refreshes& running = running_refreshes();
+                    std::lock_guard<std::mutex> lock(running.mutex);
+                    running.keys.erase(key);
+                }).detach();
+            }
+            catch (std::system_error const&)
+            {
+                // No thread to be had; a later request tries again
+                std::lock_guard<std::mutex> lock(running.mutex);
+                running.keys.erase(key);
+            }
+        }
+
+        //
+        // Streamed request bodies
+        //  A bodysource hands out a request body a piece at a time, from
+        //  libcurl's read callback.
+        //
+        class bodysource
+        {
+        public:
+            virtual ~bodysource() {}
+
+            // Copy up to size bytes into buffer, returning how many; 0 at
+            // the end
+            virtual size_t read(char* buffer, size_t size) = 0;
+
+            // Start again from the beginning, for another attempt; false
+            // if that can't be done
+            virtual bool rewind() = 0;
+
+            // Whether rewind can succeed, once reading has started
+            virtual bool rewindable() const = 0;
+
+            // Bytes in all, or -1 if not known in advance
+            virtual int64_t size() const = 0;
+
+            // Set data to the whole body if it is in memory in one piece,
+            // for libcurl to send from there without a read callback
+            virtual bool contiguous(std::string_view& data) const
+            {
+                (void)data;
+                return false;
+            }
+        };
+
+        // Reads from an fd, with pread from a fixed offset if it can seek
+        class fd_source : public bodysource
+        {
+        public:
+            fd_source(int fd, bool owned)
+                : fd_(fd), owned_(owned), size_(-1), position_(0)
+            {
+                start_ = lseek(fd_, 0, SEEK_CUR);
+                struct stat st;
+                if (start_ != -1 && fstat(fd_, &st) == 0 && S_ISREG(st.st_mode))
+                    size_ = std::max<int64_t>(0, st.st_size - start_);
+            }
+
+            ~fd_source()
+            {
+                if (owned_)
+                    close(fd_);
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                if (size_ >= 0)
+                    size = size_t(std::min<int64_t>(size, size_ - position_));
+                if (size == 0)
+                    return 0;
+                ssize_t n;
+                do
+                {
+                    n = start_ != -1 ? pread(fd_, buffer, size, start_ + position_)
+                                     : ::read(fd_, buffer, size);
+                } while (n == -1 && errno == EINTR);
+                if (n == -1)
+                    throw std::runtime_error(std::string("could not read request body: ") +
+                                             std::strerror(errno));
+                position_ += n;
+                return size_t(n);
+            }
+
+            bool rewind()
+            {
+                if (position_ != 0 && start_ == -1)
+                    return false;
+                position_ = 0;
+                return true;
+            }
+
+            bool rewindable() const
+            {
+                return start_ != -1;
+            }
+
+            int64_t size() const
+            {
+                return size_;
+            }
+
+        private:
+            int fd_;
+            bool owned_;
+            off_t start_;       // offset the body starts at, or -1 for pipes
+            int64_t size_;
+            int64_t position_;
+        };
+
+        class stream_source : public bodysource
+        {
+        public:
+            stream_source(std::istream& in, int64_t size)
+                : in_(in), size_(size), start_(in.tellg()), started_(false)
+            {
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                started_ = true;
+                if (!in_.read(buffer, std::streamsize(size)) && !in_.eof())
+                    throw std::runtime_error("could not read request body");
+                return size_t(in_.gcount());
+            }
+
+            bool rewind()
+            {
+                if (!started_)
+                    return true;
+                if (start_ == std::streampos(-1))
+                    return false;
+                in_.clear();
+                return bool(in_.seekg(start_));
+            }
+
+            bool rewindable() const
+            {
+                return start_ != std::streampos(-1);
+            }
+
+            int64_t size() const
+            {
+                return size_;
+            }
+
+        private:
+            std::istream& in_;
+            int64_t size_;
+            std::streampos start_;
+            bool started_;
+        };
+
+        // Reads from memory held by the caller, or by owner if set
+        class memory_source : public bodysource
+        {
+        public:
+            memory_source(std::string_view data, std::shared_ptr<void const> owner)
+                : data_(data), owner_(owner), position_(0)
+            {
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                size = std::min(size, data_.size() - position_);
+                std::memcpy(buffer, data_.data() + position_, size);
+                position_ += size;
+                return size;
+            }
+
+            bool rewind()
+            {
+                position_ = 0;
+                return true;
+            }
+
+            bool rewindable() const
+            {
+                return true;
+            }
+
+            int64_t size() const
+            {
+                return int64_t(data_.size());
+            }
+
+            bool contiguous(std::string_view& data) const
+            {
+                data = data_;
+                return true;
+            }
+
+        private:
+            std::string_view data_;
+            std::shared_ptr<void const> owner_;
+            size_t position_;
+        };
+
+        class callback_source : public bodysource
+        {
+        public:
+            callback_source(httpbody::reader read, int64_t size)
+                : read_(read), size_(size), started_(false)
+            {
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                started_ = true;
+                return read_(buffer, size);
+            }
+
+            bool rewind()
+            {
+                return !started_;
+            }
+
+            bool rewindable() const
+            {
+                return false;
+            }
+
+            int64_t size() const
+            {
+                return size_;
+            }
+
+        private:
+            httpbody::reader read_;
+            int64_t size_;
+            bool started_;
+        };
+
+        // Reads each of a sequence of sources in turn, filling the buffer
+        // across their boundaries
+        class joined_source : public bodysource
+        {
+        public:
+            explicit joined_source(std::vector<std::shared_ptr<bodysource>> const& parts)
+                : parts_(parts), current_(0), size_(0)
+            {
+                for (size_t i = 0; i < parts_.size(); ++i)
+                {
+                    int64_t size = parts_[i]->size();
+                    size_ = (size < 0 || size_ < 0) ? -1 : size_ + size;
+                }
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                size_t filled = 0;
+                while (filled < size && current_ < parts_.size())
+                {
+                    size_t n = parts_[current_]->read(buffer + filled, size - filled);
+                    if (n == 0)
+                        ++current_;
+                    filled += n;
+                }
+                return filled;
+            }
+
+            bool rewind()
+            {
+                for (size_t i = 0; i <= current_ && i < parts_.size(); ++i)
+                    if (!parts_[i]->rewind())
+                        return false;
+                current_ = 0;
+                return true;
+            }
+
+            bool rewindable() const
+            {
+                for (size_t i = 0; i < parts_.size(); ++i)
+                    if (!parts_[i]->rewindable())
+                        return false;
+                return true;
+            }
+
+            int64_t size() const
+            {
+                return size_;
+            }
+
+        private:
+            std::vector<std::shared_ptr<bodysource>> parts_;
+            size_t current_;    // the part being read
+            int64_t size_;
+        };
+
+        //
+        // Request compression
+        //  An encoder compresses a stream a piece at a time, for a
+        //  compressed_source to compress a body as it is read.
+        //
+        class encoder
+        {
+        public:
+            virtual ~encoder() {}
+
+            // Compress from in into out, advancing both past what was
+            // used; with finish, once in holds the last of the input, end
+            // the stream. Returns true once the stream has been ended.
+            virtual bool encode(char const*&    in,
+                                size_t&         in_size,
+                                char*&          out,
+                                size_t&         out_size,
+                                bool            finish) = 0;
+
+            // Start a new stream
+            virtual void reset() = 0;
+
+            // The Content-Encoding of the output
+            virtual char const* name() const = 0;
+        };
+
+        class gzip_encoder : public encoder
+        {
+        public:
+            explicit gzip_encoder(int level)
+            {
+                stream_.zalloc = Z_NULL;
+                stream_.zfree = Z_NULL;
+                stream_.opaque = Z_NULL;
+                if (Z_OK != deflateInit2(&stream_, level, Z_DEFLATED, MAX_WBITS+16,
+                        MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+                    throw std::runtime_error("error initializing deflate");
+            }
+
+            ~gzip_encoder()
+            {
+                deflateEnd(&stream_);
+            }
+
+            bool encode(char const*& in, size_t& in_size, char*& out, size_t& out_size,
+                        bool finish)
+            {
+                stream_.next_in = (unsigned char*)in;
+                stream_.avail_in = uInt(in_size);
+                stream_.next_out = (unsigned char*)out;
+                stream_.avail_out = uInt(out_size);
+                int code = deflate(&stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+                if (code == Z_STREAM_ERROR)
+                    throw std::runtime_error("failed to deflate");
+                in = (char const*)stream_.next_in;
+                in_size = stream_.avail_in;
+                out = (char*)stream_.next_out;
+                out_size = stream_.avail_out;
+                return code == Z_STREAM_END;
+            }
+
+            void reset()
+            {
+                deflateReset(&stream_);
+            }
+
+            char const* name() const
+            {
+                return "gzip";
+            }
+
+        private:
+            z_stream stream_;
+        };
+
+        //
+        // Parallel gzip, as pigz does it
+        //  Input is cut into blocks, each deflated on its own thread as raw
+        //  deflate primed with the 32 KB of input before it. All but the
+        //  last block end with a sync flush, which leaves them byte-aligned
+        //  and unterminated, so they join into one deflate stream; the gzip
+        //  header and trailer go around that, with the CRC combined from
+        //  the blocks'.
+        //
+        struct deflated_block
+        {
+            std::string data;
+            uLong crc;
+        };
+
+        deflated_block deflate_block(char const*    data,
+                                     size_t         size,
+                                     char const*    window,
+                                     size_t         window_size,
+                                     int            level,
+                                     bool           last)
+        {
+            z_stream stream;
+            stream.zalloc = Z_NULL;
+            stream.zfree = Z_NULL;
+            stream.opaque = Z_NULL;
+            if (Z_OK != deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS,
+                    MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+                throw std::runtime_error("error initializing deflate");
+            if (window_size > 0)
+                deflateSetDictionary(&stream, (Bytef const*)window, uInt(window_size));
+
+            // Room for the flush's empty stored block as well
+            deflated_block block;
+            block.data.resize(deflateBound(&stream, size) + 16);
+            stream.next_in = (Bytef*)data;
+            stream.avail_in = uInt(size);
+            stream.next_out = (Bytef*)&block.data[0];
+            stream.avail_out = uInt(block.data.size());
+            int code = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+            bool complete = code == (last ? Z_STREAM_END : Z_OK) &&
+                            stream.avail_in == 0 && stream.avail_out > 0;
+            block.data.resize(block.data.size() - stream.avail_out);
+            deflateEnd(&stream);
+            if (!complete)
+                throw std::runtime_error("failed to completely deflate");
+
+            block.crc = crc32(crc32(0, Z_NULL, 0), (Bytef const*)data, uInt(size));
+            return block;
+        }
+
+        class parallel_gzip_encoder : public encoder
+        {
+        public:
+            static constexpr size_t block_size = 131072;
+            static constexpr size_t window_size = 32768;
+
+            parallel_gzip_encoder(int level, unsigned threads)
+                : level_(level), threads_(threads)
+            {
+                batch_.reserve(block_size * threads_);
+                reset();
+            }
+
+            bool encode(char const*& in, size_t& in_size, char*& out, size_t& out_size,
+                        bool finish)
+            {
+                for (;;)
+                {
+                    size_t n = std::min(out_size, output_.size() - drained_);
+                    std::memcpy(out, output_.data() + drained_, n);
+                    out += n;
+                    out_size -= n;
+                    drained_ += n;
+                    if (drained_ < output_.size())
+                        return false;
+                    if (finished_)
+                        return true;
+
+                    // Gather a block for each thread, then compress them
+                    size_t take = std::min(in_size, block_size * threads_ - batch_.size());
+                    batch_.append(in, take);
+                    in += take;
+                    in_size -= take;
+                    bool last = finish && in_size == 0;
+                    if (!last && batch_.size() < block_size * threads_)
+                        return false;
+                    compress(last);
+                }
+            }
+
+            void reset()
+            {
+                batch_.clear();
+                window_.clear();
+                output_.clear();
+                drained_ = 0;
+                crc_ = crc32(0, Z_NULL, 0);
+                total_ = 0;
+                started_ = finished_ = false;
+            }
+
+            char const* name() const
+            {
+                return "gzip";
+            }
+
+        private:
+            void compress(bool last)
+            {
+                output_.clear();
+                drained_ = 0;
+                if (!started_)
+                {
+                    // Magic, deflate, no flags or time, Unix
+                    static const char header[] = "\x1f\x8b\x08\0\0\0\0\0\0\x03";
+                    output_.assign(header, sizeof(header) - 1);
+                    started_ = true;
+                }
+
+                size_t blocks = std::max<size_t>(1, (batch_.size() + block_size - 1) / block_size);
+                std::vector<std::future<deflated_block>> work;
+                for (size_t i = 0; i < blocks; ++i)
+                {
+                    char const* data = batch_.data() + i * block_size;
+                    size_t size = std::min(block_size, batch_.size() - i * block_size);
+                    char const* window = i ? data - window_size : window_.data();
+                    size_t wsize = i ? window_size : window_.size();
+                    work.push_back(std::async(std::launch::async, &deflate_block, data, size,
+                                              window, wsize, level_, last && i + 1 == blocks));
+                }
+                for (size_t i = 0; i < blocks; ++i)
+                {
+                    deflated_block block = work[i].get();
+                    output_ += block.data;
+                    size_t size = std::min(block_size, batch_.size() - i * block_size);
+                    crc_ = crc32_combine(crc_, block.crc, z_off_t(size));
+                }
+
+                // The next batch's first block is primed with the end of this one
+                if (batch_.size() >= window_size)
+                    window_.assign(batch_, batch_.size() - window_size, window_size);
+                else
+                {
+                    window_ += batch_;
+                    if (window_.size() > window_size)
+                        window_.erase(0, window_.size() - window_size);
+                }
+                total_ += batch_.size();
+                batch_.clear();
+
+                if (last)
+                {
+                    // CRC and size modulo 2^32, little-endian
+                    for (int shift = 0; shift < 32; shift += 8)
+                        output_ += char((crc_ >> shift) & 0xff);
+                    for (int shift = 0; shift < 32; shift += 8)
+                        output_ += char((total_ >> shift) & 0xff);
+                    finished_ = true;
+                }
+            }
+
+            int level_;
+            unsigned threads_;
+            std::string batch_;     // input waiting to be compressed
+            std::string window_;    // the 32 KB of input before it
+            std::string output_;    // compressed, not yet handed out ...
+            size_t drained_;        // ... past this much
+            uLong crc_;
+            uint64_t total_;
+            bool started_;
+            bool finished_;
+        };
+
+#if defined(HURL_WITH_ZSTD)
+        class zstd_encoder : public encoder
+        {
+        public:
+            zstd_encoder(int level, dictionary const& dict)
+                : context_(ZSTD_createCCtx())
+            {
+                if (context_ == NULL)
+                    throw std::runtime_error("error initializing zstd");
+                if (level < 0)
+                    level = ZSTD_CLEVEL_DEFAULT;
+                ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, level);
+                // Kept across reset; the frame names it by id
+                if (dict)
+                    ZSTD_CCtx_refCDict(context_, dictionary_access::get(dict).cdict(level));
+            }
+
+            ~zstd_encoder()
+            {
+                ZSTD_freeCCtx(context_);
+            }
+
+            bool encode(char const*& in, size_t& in_size, char*& out, size_t& out_size,
+                        bool finish)
+            {
+                ZSTD_inBuffer input = { in, in_size, 0 };
+                ZSTD_outBuffer output = { out, out_size, 0 };
+                size_t left = ZSTD_compressStream2(context_, &output, &input,
+                                                   finish ? ZSTD_e_end : ZSTD_e_continue);
+                if (ZSTD_isError(left))
+                    throw std::runtime_error(ZSTD_getErrorName(left));
+                in += input.pos;
+                in_size -= input.pos;
+                out += output.pos;
+                out_size -= output.pos;
+                return finish && in_size == 0 && left == 0;
+            }
+
+            void reset()
+            {
+                ZSTD_CCtx_reset(context_, ZSTD_reset_session_only);
+            }
+
+            char const* name() const
+            {
+                return "zstd";
+            }
+
+        private:
+            ZSTD_CCtx* context_;
+        };
+#endif
+
+#if defined(HURL_WITH_BROTLI)
+        class brotli_encoder : public encoder
+        {
+        public:
+            // Brotli's own default, 11, is too slow for streaming uploads
+            explicit brotli_encoder(int level)
+                : state_(NULL), level_(level < 0 ? 5 : level)
+            {
+                reset();
+            }
+
+            ~brotli_encoder()
+            {
+                BrotliEncoderDestroyInstance(state_);
+            }
+
+            bool encode(char const*& in, size_t& in_size, char*& out, size_t& out_size,
+                        bool finish)
+            {
+                uint8_t const* next_in = (uint8_t const*)in;
+                uint8_t* next_out = (uint8_t*)out;
+                if (!BrotliEncoderCompressStream(state_,
+                        finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                        &in_size, &next_in, &out_size, &next_out, NULL))
+                    throw std::runtime_error("failed to compress with brotli");
+                in = (char const*)next_in;
+                out = (char*)next_out;
+                return BrotliEncoderIsFinished(state_);
+            }
+
+            void reset()
+            {
+                if (state_)
+                    BrotliEncoderDestroyInstance(state_);
+                state_ = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+                if (state_ == NULL)
+                    throw std::runtime_error("error initializing brotli");
+                BrotliEncoderSetParameter(state_, BROTLI_PARAM_QUALITY, uint32_t(level_));
+            }
+
+            char const* name() const
+            {
+                return "br";
+            }
+
+        private:
+            BrotliEncoderState* state_;
+            int level_;
+        };
+#endif
+
+        // Threads to gzip on, given 0 for one per core. Priming blocks
+        // costs more than it saves on a single core.
+        unsigned gzip_threads(unsigned threads)
+        {
+            return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        std::unique_ptr<encoder> make_encoder(compressionpolicy const& policy)
+        {
+            switch (policy.algorithm)
+            {
+            case compressionpolicy::gzip:
+                if (gzip_threads(policy.threads) > 1)
+                    return std::unique_ptr<encoder>(new parallel_gzip_encoder(policy.level,
+                                                        gzip_threads(policy.threads)));
+                return std::unique_ptr<encoder>(new gzip_encoder(policy.level));
+#if defined(HURL_WITH_ZSTD)
+            case compressionpolicy::zstd:
+                return std::unique_ptr<encoder>(new zstd_encoder(policy.level,
+                                                                 policy.dictionary));
+#endif
+#if defined(HURL_WITH_BROTLI)
+            case compressionpolicy::brotli:
+                return std::unique_ptr<encoder>(new brotli_encoder(policy.level));
+#endif
+            default:
+                throw std::runtime_error("compression algorithm not built into hurl");
+            }
+        }
+
+        // gzip on the given number of threads; 0 for one per core
+        std::string gzip(std::string_view input, unsigned threads)
+        {
+            threads = gzip_threads(threads);
+            if (threads == 1)
+                return gzip(input);
+            parallel_gzip_encoder coder(Z_DEFAULT_COMPRESSION, threads);
+            std::string result;
+            std::vector<char> buffer(1 << 20);
+            char const* in = input.data();
+            size_t in_size = input.size();
+            bool done = false;
+            while (!done)
+            {
+                char* out = buffer.data();
+                size_t out_size = buffer.size();
+                done = coder.encode(in, in_size, out, out_size, true);
+                result.append(buffer.data(), buffer.size() - out_size);
+            }
+            return result;
+        }
+
+        //
+        // Adaptive compression
+        //  Whether a body is worth compressing is judged from a sample of
+        //  its first bytes: data that is already compressed, or random,
+        //  uses nearly all 256 byte values evenly, and deflate gains
+        //  little on it.
+        //
+        const size_t compression_sample = 4096;
+
+        // The compressed size over the original size to expect for data
+        // like the given sample, from the order-0 entropy of its bytes.
+        // Repeated strings make text compress better than this, so it
+        // mostly tells apart data that won't compress at all.
+        double estimate_ratio(char const* data, size_t size)
+        {
+            if (size == 0)
+                return 1;
+            uint32_t counts[256] = {};
+            for (size_t i = 0; i < size; ++i)
+                ++counts[(unsigned char)data[i]];
+            double bits = 0;
+            for (int i = 0; i < 256; ++i)
+            {
+                if (counts[i] == 0)
+                    continue;
+                double p = double(counts[i]) / size;
+                bits -= p * std::log2(p);
+            }
+            return bits / 8;
+        }
+
+        // Reads a sample taken from the start of a source that can't be
+        // rewound, then the rest of it
+        class prefixed_source : public bodysource
+        {
+        public:
+            prefixed_source(std::string const& prefix, bodysource& rest)
+                : prefix_(prefix), rest_(rest), position_(0), started_(false)
+            {
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                if (position_ < prefix_.size())
+                {
+                    size = std::min(size, prefix_.size() - position_);
+                    std::memcpy(buffer, prefix_.data() + position_, size);
+                    position_ += size;
+                    return size;
+                }
+                started_ = true;
+                return rest_.read(buffer, size);
+            }
+
+            bool rewind()
+            {
+                if (started_)
+                    return false;
+                position_ = 0;
+                return true;
+            }
+
+            bool rewindable() const
+            {
+                return false;
+            }
+
+            int64_t size() const
+            {
+                return rest_.size();
+            }
+
+        private:
+            std::string prefix_;
+            bodysource& rest_;
+            size_t position_;
+            bool started_;  // whether reading has moved on to rest_
+        };
+
+        // Whether the body read by source looks worth compressing, given
+        // the policy. The sample read to decide is put back: by rewinding
+        // source, or by replacing it with a prefixed_source kept in holder.
+        bool worth_compressing(bodysource*&                     source,
+                               std::unique_ptr<bodysource>&     holder,
+                               compressionpolicy const&         policy)
+        {
+            if (policy.max_ratio >= 1)
+                return true;
+
+            std::string sample(compression_sample, '\0');
+            size_t got = 0, n;
+            while (got < sample.size() &&
+                   (n = source->read(&sample[got], sample.size() - got)) > 0)
+                got += n;
+            sample.resize(got);
+
+            if (!source->rewind())
+            {
+                holder.reset(new prefixed_source(sample, *source));
+                source = holder.get();
+            }
+            return estimate_ratio(sample.data(), sample.size()) <= policy.max_ratio;
+        }
+
+        // Compresses another source as it is read, when its size is
+        // unknown and it is sent chunked, or all at once by buffer. Up to
+        // keep bytes of output are kept, so that a body sent in full can
+        // be sent again as it was rather than compressed again.
+        class compressed_source : public bodysource
+        {
+        public:
+            compressed_source(bodysource&               inner,
+                              std::unique_ptr<encoder>  coder,
+                              uint64_t                  keep)
+                : inner_(inner), encoder_(std::move(coder)), input_(65536),
+                  next_(NULL), pending_(0), ended_(false), done_(false),
+                  keep_(keep), keeping_(true), buffered_(false), position_(0)
+            {
+            }
+
+            // Compress the whole of inner now, to be sent from memory with
+            // a Content-Length
+            void buffer()
+            {
+                size_t used = 0;
+                while (!done_)
+                {
+                    if (whole_.size() - used < input_.size())
+                        whole_.resize(whole_.size() * 2 + input_.size());
+                    used += compress(&whole_[used], whole_.size() - used);
+                }
+                whole_.resize(used);
+                buffered_ = true;
+            }
+
+            size_t read(char* buffer, size_t size)
+            {
+                if (buffered_)
+                {
+                    size = std::min(size, whole_.size() - position_);
+                    std::memcpy(buffer, whole_.data() + position_, size);
+                    position_ += size;
+                    return size;
+                }
+
+                size = compress(buffer, size);
+                if (keeping_ && whole_.size() + size <= keep_)
+                {
+                    whole_.append(buffer, size);
+                }
+                else if (keeping_)
+                {
+                    keeping_ = false;
+                    std::string().swap(whole_);
+                }
+                return size;
+            }
+
+            bool rewind()
+            {
+                if (done_ && keeping_)
+                    buffered_ = true;
+                if (buffered_)
+                {
+                    position_ = 0;
+                    return true;
+                }
+                if (!inner_.rewind())
+                    return false;
+                encoder_->reset();
+                pending_ = 0;
+                ended_ = done_ = false;
+                whole_.clear();
+                keeping_ = true;
+                return true;
+            }
+
+            bool rewindable() const
+            {
+                return buffered_ || (done_ && keeping_) || inner_.rewindable();
+            }
+
+            int64_t size() const
+            {
+                return buffered_ ? int64_t(whole_.size()) : -1;
+            }
+
+            bool contiguous(std::string_view& data) const
+            {
+                data = whole_;
+                return buffered_;
+            }
+
+            char const* encoding() const
+            {
+                return encoder_->name();
+            }
+
+        private:
+            // Fill buffer with the next of the compressed body, returning
+            // how much was written; 0 at the end
+            size_t compress(char* buffer, size_t size)
+            {
+                char* out = buffer;
+                size_t room = size;
+                while (room == size && !done_)
+                {
+                    if (pending_ == 0 && !ended_)
+                    {
+                        pending_ = inner_.read(&input_[0], input_.size());
+                        next_ = &input_[0];
+                        ended_ = pending_ == 0;
+                    }
+                    done_ = encoder_->encode(next_, pending_, out, room, ended_);
+                }
+                return size - room;
+            }
+
+            bodysource& inner_;
+            std::unique_ptr<encoder> encoder_;
+            std::vector<char> input_;
+            char const* next_;      // input not yet compressed ...
+            size_t pending_;        // ... and how much of it
+            bool ended_;            // whether inner has been read to the end
+            bool done_;             // whether the encoder has ended its stream
+            std::string whole_;     // the compressed body so far, or in full
+            uint64_t keep_;         // the most output to keep in whole_
+            bool keeping_;          // whether whole_ has all output so far
+            bool buffered_;         // whether reads come from whole_ ...
+            size_t position_;       // ... and where from
+        };
+
+        struct body_access
+        {
+            static bodysource& source(httpbody const& body)
+            {
+                return *body.source_;
+            }
+
+            static std::shared_ptr<bodysource> const& share(httpbody const& body)
+            {
+                return body.source_;
+            }
+
+            static httpbody make(bodysource* source)
+            {
+                return httpbody(std::shared_ptr<bodysource>(source));
+            }
+        };
+
+        // The state of a body being sent, for libcurl's callbacks. An
+        // exception thrown by the source aborts the transfer and is kept
+        // to be rethrown.
+        struct bodyreader
+        {
+            bodysource& source;
+            std::exception_ptr error;
+
+            static size_t read(char* buffer, size_t size, size_t nitems, void* data)
+            {
+                bodyreader* self = static_cast<bodyreader*>(data);
+                try
+                {
+                    return self->source.read(buffer, size * nitems);
+                }
+                catch (...)
+                {
+                    self->error = std::current_exception();
+                    return CURL_READFUNC_ABORT;
+                }
+            }
+
+            // Called by libcurl to resend the body, e.g. after a redirect
+            static int seek(void* data, curl_off_t offset, int origin)
+            {
+                bodyreader* self = static_cast<bodyreader*>(data);
+                if (offset != 0 || origin != SEEK_SET)
+                    return CURL_SEEKFUNC_CANTSEEK;
+                return self->source.rewind() ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_CANTSEEK;
+            }
+        };
+
+        void prepare_upload(handle&         curl,
+                            bodyreader&     reader,
+                            bool            put)
+        {
+            // In keeping with hurl's "do the wrong thing easily"
+            // philosophy, disable "Expect: 100-continue" header
+            curl.add_header("Expect:");
+
+            // A body already in memory is sent from where it is
+            std::string_view data;
+            if (reader.source.contiguous(data))
+            {
+                if (put)
+                    curl.setopt(CURLOPT_CUSTOMREQUEST, "PUT");
+                curl.setopt(CURLOPT_POSTFIELDSIZE_LARGE, curl_off_t(data.size()));
+                curl.setopt(CURLOPT_POSTFIELDS, data.empty() ? "" : data.data());
+                return;
+            }
+
+            int64_t size = reader.source.size();
+            if (put)
+            {
+                curl.setopt(CURLOPT_UPLOAD, 1L);
+                curl.setopt(CURLOPT_INFILESIZE_LARGE, curl_off_t(size));
+            }
+            else
+            {
+                curl.setopt(CURLOPT_POST, 1L);
+                curl.setopt(CURLOPT_POSTFIELDSIZE_LARGE, curl_off_t(size));
+            }
+            curl.setopt(CURLOPT_READFUNCTION, &bodyreader::read);
+            curl.setopt(CURLOPT_READDATA, &reader);
+            curl.setopt(CURLOPT_SEEKFUNCTION, &bodyreader::seek);
+            curl.setopt(CURLOPT_SEEKDATA, &reader);
+            if (size < 0)
+                curl.add_header("Transfer-Encoding: chunked");
+        }
+
+        // Whether an Accept-Encoding value lists the given coding
+        bool accepts_coding(std::string_view accept, std::string_view coding)
+        {
+            bool found = false;
+            split_list(accept, [&](std::string_view item)
+            {
+                if (iequals(trim(item.substr(0, item.find(';'))), coding))
+                    found = true;
+            });
+            return found;
+        }
+
+        //
+        // upload
+        //  POST or PUT a body read as it is sent. A body that can't be
+        //  read again is given a single attempt.
+        //
+        httpresponse upload(handle&             curl,
+                            std::string const&  url,
+                            httpbody const&     body,
+                            bool                put,
+                            limits const&       limit,
+                            caches const&       store,
+                            retrying const&     retry,
+                            compressionpolicy const& compression,
+                            std::string const&  content_type = std::string())
+        {
+            httpresponse result;
+            std::ostringstream ss;
+            prepare_basic(curl, result, ss, url, limit);
+
+            bodysource* source = &body_access::source(body);
+            if (!source->rewind())
+                throw curl_error(CURLE_SEND_FAIL_REWIND);
+            std::unique_ptr<bodysource> prefixed;
+            std::unique_ptr<compressed_source> compressed;
+            int64_t size = source->size();
+            if (compression.algorithm != compressionpolicy::none &&
+                    (size < 0 || uint64_t(size) >= compression.threshold))
+            {
+                if (worth_compressing(source, prefixed, compression))
+                {
+                    compressed.reset(new compressed_source(*source, make_encoder(compression),
+                                                           compression.buffer_limit));
+                    if (size >= 0 && uint64_t(size) <= compression.buffer_limit)
+                        compressed->buffer();
+                    source = compressed.get();
+                    ++totals.compressed;
+                }
+                else
+                {
+                    ++totals.compression_skipped;
+                }
+            }
+
+            bodyreader reader = { *source, std::exception_ptr() };
+            prepare_upload(curl, reader, put);
+            if (!content_type.empty())
+                curl.add_header("Content-Type: " + content_type);
+            if (compressed)
+                curl.add_header(std::string("Content-Encoding: ") + compressed->encoding());
+
+            retrying once = retry;
+            if (!reader.source.rewindable())
+                once.policy.attempts = 1;
+
+            with_retries(url, result, once, limit.until, put, [&]()
+            {
+                try
+                {
+                    curl.perform();
+                }
+                catch (curl_error const&)
+                {
+                    if (reader.error)
+                        std::rethrow_exception(reader.error);
+                    throw;
+                }
+                curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
+            }, [&]()
+            {
+                ss.str(std::string());
+                if (!reader.source.rewind())
+                    throw curl_error(CURLE_SEND_FAIL_REWIND);
+            });
+            result.body.assign(ss.str());
+            process_response(result);
+
+            // The server doesn't take our coding and says which it does
+            // (RFC 7694); send it again in one of those, or none
+            if (result.status == 415 && compressed && body_access::source(body).rewindable())
+            {
+                std::string_view accept = result.header("accept-encoding");
+                if (result.headers.count("accept-encoding") != 0 &&
+                        !accepts_coding(accept, compressed->encoding()))
+                {
+                    compressionpolicy fallback = compression;
+                    fallback.algorithm = accepts_coding(accept, "gzip") ?
+                        compressionpolicy::gzip : compressionpolicy::none;
+                    return upload(curl, url, body, put, limit, store, retry, fallback,
+                                  content_type);
+                }
+            }
+
+            if (result.status >= 200 && result.status < 400)
+                cache_access::invalidate(store, url);
+            return result;
+        }
+
+        httpresponse post(handle&                   curl,
+                          std::string const&        url,
+                          std::string_view          data,
+                          limits const&             limit,
+                          caches const&             store,
+                          retrying const&           retry,
+                          compressionpolicy const&  compression)
+        {
+            return upload(curl, url, httpbody::view(data), false, limit, store, retry,
+                          compression);
+        }
+
+        std::shared_ptr<compressionpolicy const> default_compression;
+
+        // The policy for a request when none is set: the default for a
+        // string body, and no compression for an httpbody or multipart
+        // one, which is compressed only when asked for
+        compressionpolicy unset_compression(bool string_body)
+        {
+            compressionpolicy policy;
+            if (!string_body)
+                policy.algorithm = compressionpolicy::none;
+            return policy;
+        }
+
+        compressionpolicy default_compressing(std::optional<compressionpolicy> const& given,
+                                              bool string_body)
+        {
+            if (given)
+                return *given;
+            std::shared_ptr<compressionpolicy const> policy =
+                std::atomic_load(&default_compression);
+            return policy ? *policy : unset_compression(string_body);
+        }
+    }
+
+    compressionpolicy::compressionpolicy()
+        : algorithm(gzip), threshold(10240), level(-1), max_ratio(0.9), threads(1),
+          buffer_limit(4 << 20)
+    {
+    }
+
+    void setcompression(compressionpolicy const& policy)
+    {
+        std::atomic_store(&detail::default_compression,
+                          std::shared_ptr<compressionpolicy const>(new compressionpolicy(policy)));
+    }
+
+    httpbody::httpbody(std::shared_ptr<detail::bodysource> source)
+        : source_(source)
+    {
+    }
+
+    httpbody httpbody::file(std::string const& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            throw std::runtime_error("could not open " + path);
+        return detail::body_access::make(new detail::fd_source(fd, true));
+    }
+
+    httpbody httpbody::fd(int fd)
+    {
+        return detail::body_access::make(new detail::fd_source(fd, false));
+    }
+
+    httpbody httpbody::stream(std::istream& in, int64_t size)
+    {
+        return detail::body_access::make(new detail::stream_source(in, size));
+    }
+
+    httpbody httpbody::view(std::string_view data)
+    {
+        return detail::body_access::make(
+            new detail::memory_source(data, std::shared_ptr<void const>()));
+    }
+
+    httpbody httpbody::buffer(std::shared_ptr<std::string const> data)
+    {
+        if (!data)
+            return view(std::string_view());
+        return detail::body_access::make(new detail::memory_source(*data, data));
+    }
+
+    httpbody httpbody::join(std::vector<httpbody> const& parts)
+    {
+        std::vector<std::shared_ptr<detail::bodysource>> sources;
+        sources.reserve(parts.size());
+        for (size_t i = 0; i < parts.size(); ++i)
+            sources.push_back(detail::body_access::share(parts[i]));
+        return detail::body_access::make(new detail::joined_source(sources));
+    }
+
+    httpbody httpbody::callback(reader read, int64_t size)
+    {
+        return detail::body_access::make(new detail::callback_source(read, size));
+    }
+
+    int64_t httpbody::size() const
+    {
+        return source_->size();
+    }
+
+
+    //
+    // multipart implementation
+    //
+    namespace detail
+    {
+        // A field name or filename as a quoted string, percent-encoding
+        // quotes and line breaks as browsers do (RFC 7578 2)
+        std::string form_quoted(std::string const& s)
+        {
+            std::string result("\"");
+            for (size_t i = 0; i < s.size(); ++i)
+            {
+                switch (s[i])
+                {
+                case '"':  result += "%22"; break;
+                case '\r': result += "%0D"; break;
+                case '\n': result += "%0A"; break;
+                default:   result += s[i];
+                }
+            }
+            result += '"';
+            return result;
+        }
+
+        // A boundary random enough not to turn up in any part
+        std::string make_boundary()
+        {
+            thread_local std::mt19937_64 random(std::random_device{}());
+            char buf[40];
+            snprintf(buf, sizeof(buf), "hurl-%016llx%016llx",
+                     (unsigned long long)random(), (unsigned long long)random());
+            return buf;
+        }
+    }
+
+    multipart::multipart()
+        : boundary_(detail::make_boundary())
+    {
+    }
+
+    multipart& multipart::field(std::string const& name, std::string const& value)
+    {
+        add("Content-Disposition: form-data; name=" + detail::form_quoted(name) + "\r\n",
+            httpbody::buffer(std::make_shared<std::string const>(value)));
+        return *this;
+    }
+
+    multipart& multipart::file(std::string const&  name,
+                               std::string const&  path,
+                               std::string const&  content_type)
+    {
+        return part(name, httpbody::file(path), path.substr(path.rfind('/') + 1),
+                    content_type);
+    }
+
+    multipart& multipart::part(std::string const&  name,
+                               httpbody const&     body,
+                               std::string const&  filename,
+                               std::string const&  content_type)
+    {
+        std::string headers = "Content-Disposition: form-data; name=" +
+                              detail::form_quoted(name);
+        if (!filename.empty())
+            headers += "; filename=" + detail::form_quoted(filename);
+        headers += "\r\n";
+        if (!content_type.empty())
+            headers += "Content-Type: " + content_type + "\r\n";
+        add(headers, body);
+        return *this;
+    }
+
+    std::string multipart::content_type() const
+    {
+        return "multipart/form-data; boundary=" + boundary_;
+    }
+
+    httpbody multipart::body() const
+    {
+        std::vector<httpbody> parts(parts_);
+        parts.push_back(httpbody::buffer(
+            std::make_shared<std::string const>("--" + boundary_ + "--\r\n")));
+        return httpbody::join(parts);
+    }
+
+    void multipart::add(std::string const& headers, httpbody const& body)
+    {
+        parts_.push_back(httpbody::buffer(
+            std::make_shared<std::string const>("--" + boundary_ + "\r\n" + headers + "\r\n")));
+        parts_.push_back(body);
+        parts_.push_back(httpbody::view("\r\n"));
+    }
+
+    namespace detail
+    {
+        //
+        // Validators for downloaded files
+        //  A downloaded file's modification time is set from the response's
+        //  Last-Modified, and the response's validators are kept in an
+        //  extended attribute, with the modification time hurl left the
+        //  file with. A later download of the same file is made conditional
+        //  only if the attribute is there and the file hasn't been modified
+        //  since; any other file at the path is transferred again. On
+        //  filesystems without extended attributes, downloads are never
+        //  conditional.
+        //
+        const char* const validators_attribute = "user.hurl.validators";
+
+        struct file_validators
+        {
+            std::string etag;
+            std::string last_modified;
+        };
+
+        // The validators recorded for a file, if it is as hurl left it
+        bool read_validators(std::string const& path, time_t mtime, file_validators& found)
+        {
+            char buf[1024];
+#if defined(__APPLE__)
+            ssize_t size = getxattr(path.c_str(), validators_attribute, buf, sizeof(buf), 0, 0);
+#else
+            ssize_t size = getxattr(path.c_str(), validators_attribute, buf, sizeof(buf));
+#endif
+            if (size <= 0)
+                return false;
+
+            // "mtime <seconds>", then "etag <value>" and "modified <value>"
+            // as the response had them, one per line
+            bool current = false;
+            std::string_view text(buf, size);
+            while (!text.empty())
+            {
+                size_t eol = text.find('\n');
+                std::string_view line = text.substr(0, eol);
+                size_t space = line.find(' ');
+                std::string_view key = line.substr(0, space);
+                std::string_view value = space == std::string_view::npos ?
+                    std::string_view() : line.substr(space + 1);
+                if (key == "mtime")
+                    current = parse_seconds(value) == long(mtime);
+                else if (key == "etag")
+                    found.etag = value;
+                else if (key == "modified")
+                    found.last_modified = value;
+                if (eol == std::string_view::npos)
+                    break;
+                text.remove_prefix(eol + 1);
+            }
+            return current && (!found.etag.empty() || !found.last_modified.empty());
+        }
+
+        void record_validators(std::string const& path, httpresponse const& response)
+        {
+            time_t modified = parse_date(response.header(h::last_modified));
+            if (modified != -1)
+            {
+                timeval times[2] = { { modified, 0 }, { modified, 0 } };
+                utimes(path.c_str(), times);
+            }
+
+            std::string_view etag = response.header(h::etag);
+            std::string_view last_modified = response.header(h::last_modified);
+            struct stat st;
+            if ((etag.empty() && last_modified.empty()) || stat(path.c_str(), &st) != 0)
+            {
+#if defined(__APPLE__)
+                removexattr(path.c_str(), validators_attribute, 0);
+#else
+                removexattr(path.c_str(), validators_attribute);
+#endif
+                return;
+            }
+
+            std::string text = "mtime " + std::to_string(long(st.st_mtime)) + "\n";
+            if (!etag.empty())
+                text += "etag " + std::string(etag) + "\n";
+            if (!last_modified.empty())
+                text += "modified " + std::string(last_modified) + "\n";
+#if defined(__APPLE__)
+            setxattr(path.c_str(), validators_attribute, text.data(), text.size(), 0, 0);
+#else
+            setxattr(path.c_str(), validators_attribute, text.data(), text.size(), 0);
+#endif
+        }
+
+        // Move a completed download into place
+        void replace_file(std::string const& from, std::string const& to)
+        {
+            if (std::rename(from.c_str(), to.c_str()) != 0)
+            {
+                std::remove(from.c_str());
+                throw std::runtime_error("could not replace " + to);
+            }
+        }
+
+        httpresponse download(handle&           curl,
+                        std::string const&      url,
+                        std::string const&      localpath,
+                        limits const&           limit,
+                        caches const&           store = caches(),
+                        retrying const&         retry = retrying())
+        {
+            // Download into a temporary file next to the target, so that an
+            // existing copy survives a failed, unsuccessful or unmodified
+            // transfer
+            httpresponse result;
+            std::string partpath = localpath + ".part";
+            std::ofstream out(partpath.c_str(), std::ios::out |
+                                                std::ios::binary |
+                                                std::ios::trunc);
+            // NOTE: download currently doesn't allow compressed responses
+            prepare_basic(curl, result, out, url, limit, false);
+
+            // A fresh copy in the disk cache is used without a request
+            std::shared_ptr<cache_entry const> stored = cache_access::find_file(store, url, curl);
+            if (stored && stored->fresh(time(NULL)))
+            {
+                out.close();
+                if (cache_access::copy_file(store, *stored, partpath))
+                {
+                    replace_file(partpath, localpath);
+                    record_validators(localpath, stored->response);
+                    return stored->response;
+                }
+                out.open(partpath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            }
+
+            // If there is already a copy from an earlier download, only
+            // transfer it again if the server has a different one
+            struct stat st;
+            file_validators validators;
+            bool exists = stat(localpath.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+                          read_validators(localpath, st.st_mtime, validators);
+            if (exists)
+            {
+                if (!validators.etag.empty())
+                    curl.add_header("If-None-Match: " + validators.etag);
+                if (!validators.last_modified.empty())
+                    curl.add_header("If-Modified-Since: " + validators.last_modified);
+            }
+            else if (stored)
+            {
+                add_validators(curl, stored->response);
+            }
+
+            time_t request_time = time(NULL);
+            try
+            {
+                perform(curl, url, result, retry, limit.until, true, [&out, &partpath]()
+                {
+                    out.close();
+                    out.open(partpath.c_str(), std::ios::out |
+                                               std::ios::binary |
+                                               std::ios::trunc);
+                });
+            }
+            catch (...)
+            {
+                out.close();
+                std::remove(partpath.c_str());
+                throw;
+            }
+            out.close();
+
+            if (exists && result.status == 304)
+            {
+                // Our copy is current and left as it is
+                std::remove(partpath.c_str());
+                return result;
+            }
+
+            if (stored && result.status == 304)
+            {
+                // The cached copy is current
+                result = freshen(stored->response, result);
+                if (cache_access::copy_file(store, *stored, partpath))
+                {
+                    replace_file(partpath, localpath);
+                    record_validators(localpath, result);
+                    cache_access::revalidated(store, url, curl, *stored, true, result,
+                                              request_time);
+                    return result;
+                }
+                std::remove(partpath.c_str());
+                throw std::runtime_error("could not read cached copy of " + url);
+            }
+
+            // An error page doesn't replace the file
+            if (result.status < 200 || result.status >= 300)
+            {
+                std::remove(partpath.c_str());
+                return result;
+            }
+            replace_file(partpath, localpath);
+            record_validators(localpath, result);
+            if (result.status == 200)
+                cache_access::store_file(store, url, curl, result, request_time, localpath);
+            return result;
+        }
+    }
+
+    //
+    // httpheaders implementation
+    //
+    namespace detail
+    {
+        struct field_lengths
+        {
+            uint32_t name;
+            uint32_t value;
+        };
+
+        inline field_lengths read_lengths(char const* pos)
+        {
+            field_lengths lengths;
+            std::memcpy(&lengths, pos, sizeof(lengths));
+            return lengths;
+        }
+
+        //
+        // Well-known header lookup
+        //  The names below are hashed into a 64-entry table. The hash
+        //  mixes the length and first, middle and last bytes of a name
+        //  with a seed, found at compile time, that sends every
+        //  well-known name to its own bucket, so identifying a name costs
+        //  a couple of multiplies and at most one comparison.
+        //
+        constexpr std::string_view known_headers[h::count] = {
+            "accept-ranges",
+            "age",
+            "cache-control",
+            "connection",
+            "content-disposition",
+            "content-encoding",
+            "content-language",
+            "content-length",
+            "content-location",
+            "content-range",
+            "content-type",
+            "date",
+            "etag",
+            "expires",
+            "last-modified",
+            "link",
+            "location",
+            "pragma",
+            "retry-after",
+            "server",
+            "set-cookie",
+            "strict-transport-security",
+            "transfer-encoding",
+            "vary",
+            "via",
+            "www-authenticate",
+        };
+
+        constexpr unsigned header_bucket_bits = 6;
+        constexpr unsigned header_buckets = 1u << header_bucket_bits;
+
+        constexpr uint32_t header_key(std::string_view name)
+        {
+            return uint32_t(name.size())
+                 ^ uint32_t((unsigned char)name[0]) << 8
+                 ^ uint32_t((unsigned char)name[name.size() / 2]) << 16
+                 ^ uint32_t((unsigned char)name[name.size() - 1]) << 24;
+        }
+
+        constexpr unsigned header_bucket(uint32_t key, uint32_t seed)
+        {
+            uint32_t x = (key ^ seed) * 0x9e3779b1u;
+            x ^= x >> 15;
+            x *= 0x85ebca6bu;
+            return x >> (32 - header_bucket_bits);
+        }
+
+        constexpr uint32_t find_header_seed()
+        {
+            for (uint32_t seed = 1; seed < 100000; ++seed)
+            {
+                bool used[header_buckets] = {};
+                bool unique = true;
+                for (unsigned i = 0; unique && i < h::count; ++i)
+                {
+                    unsigned b = header_bucket(header_key(known_headers[i]), seed);
+                    unique = !used[b];
+                    used[b] = true;
+                }
+                if (unique)
+                    return seed;
+            }
+            return 0;
+        }
+
+        constexpr uint32_t header_seed = find_header_seed();
+        static_assert(header_seed != 0, "no perfect hash for the well-known header names");
+
+        struct header_table
+        {
+            signed char ids[header_buckets];
+        };
+
+        constexpr header_table make_header_table()
+        {
+            header_table table = {};
+            for (unsigned b = 0; b < header_buckets; ++b)
+                table.ids[b] = -1;
+            for (unsigned i = 0; i < h::count; ++i)
+                table.ids[header_bucket(header_key(known_headers[i]), header_seed)] = i;
+            return table;
+        }
+
+        constexpr header_table known_header_table = make_header_table();
+
+        // Id of a lowercase header name, or h::count if it isn't well-known
+        inline unsigned known_header(std::string_view name)
+        {
+            if (name.empty())
+                return h::count;
+            int id = known_header_table.ids[header_bucket(header_key(name), header_seed)];
+            return (id >= 0 && known_headers[id] == name) ? id : h::count;
+        }
+    }
+
+    std::string_view httpresponse::header(std::string_view name) const
+    {
+        return headers.get(name);
+    }
+
+    std::string_view httpresponse::header(h::id id) const
+    {
+        return headers.get(id);
+    }
+
+    httpheaders::field httpheaders::const_iterator::operator*() const
+    {
+        detail::field_lengths lengths = detail::read_lengths(pos_);
+        char const* name = pos_ + sizeof(lengths);
+        return field(std::string_view(name, lengths.name),
+                     std::string_view(name + lengths.name, lengths.value));
+    }
+
+    httpheaders::const_iterator& httpheaders::const_iterator::operator++()
+    {
+        detail::field_lengths lengths = detail::read_lengths(pos_);
+        pos_ += sizeof(lengths) + lengths.name + lengths.value;
+        return *this;
+    }
+
+    httpheaders::const_iterator httpheaders::const_iterator::operator++(int)
+    {
+        const_iterator old(*this);
+        ++*this;
+        return old;
+    }
+
+    httpheaders::httpheaders()
+        : size_(0), known_()
+    {
+    }
+
+    void httpheaders::index(size_t offset, std::string_view name)
+    {
+        unsigned id = detail::known_header(name);
+        if (id != h::count)
+            known_[id] = static_cast<uint32_t>(offset + 1);
+    }
+
+    void httpheaders::add(std::string_view name, std::string_view value)
+    {
+        detail::field_lengths lengths = { static_cast<uint32_t>(name.size()),
+                                          static_cast<uint32_t>(value.size()) };
+        size_t offset = buf_.size();
+        buf_.resize(offset + sizeof(lengths) + name.size() + value.size());
+        char* out = &buf_[offset];
+        std::memcpy(out, &lengths, sizeof(lengths));
+        out += sizeof(lengths);
+        for (size_t i = 0; i < name.size(); ++i)
+            *out++ = detail::lower(name[i]);
+        std::memcpy(out, value.data(), value.size());
+        index(offset, std::string_view(&buf_[offset] + sizeof(lengths), name.size()));
+        ++size_;
+    }
+
+    bool httpheaders::addline(std::string_view line)
+    {
+        // Reserve room for the whole line up front, tokenize and lowercase
+        // the name straight into the buffer, then trim it back
+        detail::field_lengths lengths;
+        size_t offset = buf_.size();
+        buf_.resize(offset + sizeof(lengths) + line.size());
+        char* name = &buf_[offset] + sizeof(lengths);
+
+        size_t colon = detail::lower_name(name, line.data(), line.size());
+        if (colon == std::string_view::npos)
+        {
+            buf_.resize(offset);
+            return false;
+        }
+
+        const char* value = line.data() + colon + 1;
+        const char* end = line.data() + line.size();
+        while (value != end && detail::is_ows(*value))
+            ++value;
+        end = value + detail::find_eol(value, end - value);
+        while (end != value && detail::is_ows(end[-1]))
+            --end;
+
+        lengths.name = static_cast<uint32_t>(colon);
+        lengths.value = static_cast<uint32_t>(end - value);
+        std::memcpy(name + lengths.name, value, lengths.value);
+        std::memcpy(&buf_[offset], &lengths, sizeof(lengths));
+        buf_.resize(offset + sizeof(lengths) + lengths.name + lengths.value);
+        index(offset, std::string_view(name, lengths.name));
+        ++size_;
+        return true;
+    }
+
+    void httpheaders::clear()
+    {
+        buf_.clear();
+        size_ = 0;
+        std::fill(known_, known_ + h::count, 0);
+    }
+
+    void httpheaders::reserve(size_t bytes)
+    {
+        buf_.reserve(bytes);
+    }
+
+    bool httpheaders::empty() const
+    {
+        return size_ == 0;
+    }
+
+    size_t httpheaders::size() const
+    {
+        return size_;
+    }
+
+    size_t httpheaders::count(std::string_view name) const
+    {
+        size_t n = 0;
+        for (const_iterator it = begin(); it != end(); ++it)
+            if (detail::iequals(it->first, name))
+                ++n;
+        return n;
+    }
+
+    std::string_view httpheaders::get(std::string_view name) const
+    {
+        std::string_view value;
+        for (const_iterator it = begin(); it != end(); ++it)
+            if (detail::iequals(it->first, name))
+                value = it->second;
+        return value;
+    }
+
+    std::string_view httpheaders::get(h::id id) const
+    {
+        if (!known_[id])
+            return std::string_view();
+        return (*const_iterator(buf_.data() + known_[id] - 1)).second;
+    }
+
+    std::string httpheaders::operator[](std::string_view name) const
+    {
+        return std::string(get(name));
+    }
+
+    std::vector<std::string_view> httpheaders::values(std::string_view name) const
+    {
+        std::vector<std::string_view> result;
+        for (const_iterator it = begin(); it != end(); ++it)
+            if (detail::iequals(it->first, name))
+                result.push_back(it->second);
+        return result;
+    }
+
+    httpheaders::const_iterator httpheaders::begin() const
+    {
+        return const_iterator(buf_.data());
+    }
+
+    httpheaders::const_iterator httpheaders::end() const
+    {
+        return const_iterator(buf_.data() + buf_.size());
+    }
+
+
+    namespace ext
+    {
+        void extract_tarball(std::string const& file, std::string const& extractdir)
+        {
+            TAR* t;
+
+            // libtar asks for a char*? Bad libtar! Bad! No biscuit.
+            if (tar_open(&t, const_cast<char*>(file.c_str()), NULL, O_RDONLY, 0777, TAR_GNU))
+                throw std::runtime_error("could not open tar");
+
+            if (tar_extract_all(t, const_cast<char*>(extractdir.c_str())))
+                throw std::runtime_error("could not extract tar");
+
+            tar_close(t);
+        }
+    }
+
+    std::string escape(std::string const& s)
+    {
+        std::string result(detail::escaped_size(s.data(), s.size()), '\0');
+        detail::escape_into(&result[0], s.data(), s.size());
+        return result;
+    }
+
+    std::string unescape(std::string const& s)
+    {
+        std::string result(s.size(), '\0');
+        result.resize(detail::unescape_into(&result[0], s.data(), s.size()) - result.data());
+        return result;
+    }
+
+    //
+    // Implementations for the GET/POST free functions
+    //
+    httpresponse get(std::string const& url, int timeout)
+    {
+        httpoptions options;
+        options.timeout = timeout;
+        return get(url, options);
+    }
+
+    httpresponse get(std::string const& url, httpoptions const& options)
+    {
+        detail::handle curl;
+        return detail::get(curl, url, detail::make_limits(options), detail::default_caches(),
+                           detail::default_retrying(options.retry),
+                           detail::default_hedging(options.hedge),
+                           detail::coalescing ? &detail::default_flights : NULL);
+    }
+
+    httpresponse get(std::string const& url, httpparams const& params, int timeout)
+    {
+        return get(detail::query(url, params), timeout);
+    }
+
+    httpresponse post(std::string const& url, std::string const& data, int timeout)
+    {
+        httpoptions options;
+        options.timeout = timeout;
+        return post(url, data, options);
+    }
+
+    httpresponse post(std::string const&    url,
+                      std::string const&    data,
+                      httpoptions const&    options)
+    {
+        detail::handle curl;
+        return detail::post(curl, url, data, detail::make_limits(options),
+                            detail::default_caches(),
+                            detail::default_retrying(options.retry),
+                            detail::default_compressing(options.compression, true));
+    }
+
+    httpresponse post(std::string const& url, httpbody const& body, int timeout)
+    {
+        httpoptions options;
+        options.timeout = timeout;
+        return post(url, body, options);
+    }
+
+    httpresponse post(std::string const&    url,
+                      httpbody const&       body,
+                      httpoptions const&    options)
+    {
+        detail::handle curl;
+        return detail::upload(curl, url, body, false, detail::make_limits(options),
+                              detail::default_caches(),
+                              detail::default_retrying(options.retry),
+                              detail::default_compressing(options.compression, false));
+    }
+
+    httpresponse put(std::string const& url, httpbody const& body, int timeout)
+    {
+        httpoptions options;
+        options.timeout = timeout;
+        return put(url, body, options);
+    }
+
+    httpresponse put(std::string const&     url,
+                     httpbody const&        body,
+                     httpoptions const&     options)
+    {
+        detail::handle curl;
+        return detail::upload(curl, url, body, true, detail::make_limits(options),
+                              detail::default_caches(),
+                              detail::default_retrying(options.retry),
+                              detail::default_compressing(options.compression, false));
+    }
+
+    httpresponse post(std::string const& url, multipart const& form, int timeout)
+    {
+        httpoptions options;
+        options.timeout = timeout;
+        return post(url, form, options);
+    }
+
+    httpresponse post(std::string const&    url,
+                      multipart const&      form,
+                      httpoptions const&    options)
+    {
+        detail::handle curl;
+        return detail::upload(curl, url, form.body(), false, detail::make_limits(options),
+                              detail::default_caches(),
+                              detail::default_retrying(options.retry),
+                              detail::default_compressing(options.compression, false),
+                              form.content_type());
+    }
+
+    httpresponse get(std::string const& url, httpparamlist const& params, int timeout)
+    {
+        return get(detail::query(url, params), timeout);
+    }
+
+    httpresponse get(std::string const& url, httpparaminit params, int timeout)
+    {
+        return get(url, httpparams(params), timeout);
+    }
+
+    httpresponse post(std::string const& url, httpparams const& params, int timeout)
+    {
+        return post(url, detail::serialize(params), timeout);
+    }
+
+    httpresponse post(std::string const& url, httpparamlist const& params, int timeout)
+    {
+        return post(url, detail::serialize(params), timeout);
+    }
+
+    httpresponse post(std::string const& url, httpparaminit params, int timeout)
+    {
+        return post(url, httpparams(params), timeout);
+    }
+
+    httpresponse download(std::string const& url, std::string const& localpath, int timeout)
+    {
+        httpoptions options;
+        options.timeout = timeout;
+        return download(url, localpath, options);
+    }
+
+    httpresponse download(std::string const&    url,
+                          std::string const&    localpath,
+                          httpoptions const&    options)
+    {
+        detail::handle curl;
+        return detail::download(curl, url, localpath, detail::make_limits(options),
+                                detail::default_caches(),
+                                detail::default_retrying(options.retry));
+    }
+
+    httpresponse downloadtarball(std::string const& url,
+                                 std::string const& localpath,
+                                 std::string const& extractdir,
+                                 int                timeout)
+    {
         httpresponse result = download(url, localpath, timeout);
-        if (result.status == 200)
+        if (result.status == 200 || result.status == 304)
             ext::extract_tarball(localpath, extractdir);
         return result;
     }
@@ -477,13 +5600,40 @@ namespace hurl
     {
     public:
         impl(std::string const& baseurl, int timeout)
-            : base_(baseurl), timeout_(timeout)
+            : base_(baseurl), timeout_(timeout),
+              budget_(std::make_shared<detail::retrybudget>())
+        {
+        }
+
+        detail::limits limits(httpoptions const& options) const
+        {
+            return detail::make_limits(options, timeout_, deadline_);
+        }
+
+        detail::retrying retrying(httpoptions const& options) const
+        {
+            detail::retrying result;
+            result.policy = options.retry ? *options.retry : retry_;
+            result.budget = budget_;
+            return result;
+        }
+
+        compressionpolicy compression(httpoptions const& options, bool string_body) const
         {
+            if (options.compression)
+                return *options.compression;
+            return compression_ ? *compression_ : detail::unset_compression(string_body);
         }
 
         detail::handle handle_;
         std::string base_;
         int timeout_;
+        detail::caches caches_;
+        retrypolicy retry_;
+        hedgepolicy hedge_;
+        std::optional<compressionpolicy> compression_;
+        deadline deadline_;
+        std::shared_ptr<detail::retrybudget> budget_;
     };
 
     client::client(std::string const& baseurl, int timeout)
@@ -493,7 +5643,7 @@ namespace hurl
 
     client::~client()
     {
-        // This destructor is empty but vital! Without it, auto_ptr cannot
+        // This destructor is empty but vital! Without it, unique_ptr cannot
         // generate a call to impl's destructor. For an interesting look
         // at this and other PIMPL issues, see Herb Sutter's GOTW #100.
         // (http://herbsutter.com/gotw/_100)
@@ -530,40 +5680,173 @@ namespace hurl
         }
     }
 
+    void client::setcache(std::shared_ptr<cache> c)
+    {
+        impl_->caches_.memory = c;
+    }
+
+    void client::setdiskcache(std::shared_ptr<diskcache> c)
+    {
+        impl_->caches_.disk = c;
+    }
+
+    void client::setretry(retrypolicy const& policy)
+    {
+        impl_->retry_ = policy;
+    }
+
+    void client::sethedge(hedgepolicy const& policy)
+    {
+        impl_->hedge_ = policy;
+    }
+
+    void client::setcompression(compressionpolicy const& policy)
+    {
+        impl_->compression_ = policy;
+    }
+
+    void client::setdeadline(deadline const& until)
+    {
+        impl_->deadline_ = until;
+    }
+
     httpresponse client::get(std::string const& path)
     {
-        return detail::get(impl_->handle_, impl_->base_ + path, impl_->timeout_);
+        return get(path, httpoptions());
     }
 
-    httpresponse client::get(std::string const& path, httpparams const& params)
+    httpresponse client::get(std::string const& path, httpoptions const& options)
     {
         return detail::get(impl_->handle_,
-                           detail::query(impl_->base_ + path, params), impl_->timeout_);
+                           impl_->base_ + path,
+                           impl_->limits(options),
+                           impl_->caches_,
+                           impl_->retrying(options),
+                           options.hedge ? *options.hedge : impl_->hedge_);
+    }
+
+    httpresponse client::get(std::string const& path, httpparams const& params)
+    {
+        return get(detail::query(path, params));
+    }
+
+    httpresponse client::get(std::string const& path, httpparamlist const& params)
+    {
+        return get(detail::query(path, params));
+    }
+
+    httpresponse client::get(std::string const& path, httpparaminit params)
+    {
+        return get(path, httpparams(params));
     }
 
     httpresponse client::post(std::string const& path, std::string const& data)
+    {
+        return post(path, data, httpoptions());
+    }
+
+    httpresponse client::post(std::string const&    path,
+                              std::string const&    data,
+                              httpoptions const&    options)
     {
         return detail::post(impl_->handle_,
                             impl_->base_ + path,
                             data,
-                            impl_->timeout_);
+                            impl_->limits(options),
+                            impl_->caches_,
+                            impl_->retrying(options),
+                            impl_->compression(options, true));
     }
 
     httpresponse client::post(std::string const& path, httpparams const& params)
     {
-        return detail::post(impl_->handle_,
-                            impl_->base_ + path,
-                            detail::serialize(params),
-                            impl_->timeout_);
+        return post(path, detail::serialize(params));
+    }
+
+    httpresponse client::post(std::string const& path, httpparamlist const& params)
+    {
+        return post(path, detail::serialize(params));
+    }
+
+    httpresponse client::post(std::string const& path, httpparaminit params)
+    {
+        return post(path, httpparams(params));
+    }
+
+    httpresponse client::post(std::string const& path, httpbody const& body)
+    {
+        return post(path, body, httpoptions());
+    }
+
+    httpresponse client::post(std::string const&    path,
+                              httpbody const&       body,
+                              httpoptions const&    options)
+    {
+        return detail::upload(impl_->handle_,
+                              impl_->base_ + path,
+                              body,
+                              false,
+                              impl_->limits(options),
+                              impl_->caches_,
+                              impl_->retrying(options),
+                              impl_->compression(options, false));
+    }
+
+    httpresponse client::post(std::string const& path, multipart const& form)
+    {
+        return post(path, form, httpoptions());
+    }
+
+    httpresponse client::post(std::string const&    path,
+                              multipart const&      form,
+                              httpoptions const&    options)
+    {
+        return detail::upload(impl_->handle_,
+                              impl_->base_ + path,
+                              form.body(),
+                              false,
+                              impl_->limits(options),
+                              impl_->caches_,
+                              impl_->retrying(options),
+                              impl_->compression(options, false),
+                              form.content_type());
+    }
+
+    httpresponse client::put(std::string const& path, httpbody const& body)
+    {
+        return put(path, body, httpoptions());
+    }
+
+    httpresponse client::put(std::string const&     path,
+                             httpbody const&        body,
+                             httpoptions const&     options)
+    {
+        return detail::upload(impl_->handle_,
+                              impl_->base_ + path,
+                              body,
+                              true,
+                              impl_->limits(options),
+                              impl_->caches_,
+                              impl_->retrying(options),
+                              impl_->compression(options, false));
     }
 
     httpresponse client::download(std::string const& path,
                                   std::string const& localpath)
+    {
+        return download(path, localpath, httpoptions());
+    }
+
+    httpresponse client::download(std::string const& path,
+                                  std::string const& localpath,
+                                  httpoptions const& options)
     {
         return detail::download(impl_->handle_,
                                 impl_->base_ + path,
                                 localpath,
-                                impl_->timeout_);
+                                impl_->limits(options),
+                                impl_->caches_,
+                                impl_->retrying(options));
     }
 
     httpresponse client::downloadtarball(std::string const& path,
@@ -571,7 +5854,7 @@ namespace hurl
                                     std::string const& extractdir)
     {
         httpresponse result = download(path, localpath);
-        if (result.status == 200)
+        if (result.status == 200 || result.status == 304)
             ext::extract_tarball(localpath, extractdir);
         return result;
     }
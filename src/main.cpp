@@ -1,12 +1,14 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <cstdlib>
 
 #include "hurl.h"
 
 namespace hurl {
     namespace detail {
-        std::string gzip(std::string const&);
+        std::string gzip(std::string_view);
+        std::string gzip(std::string_view, unsigned threads);
         std::string gunzip(std::string const&);
     }
 }
@@ -49,8 +51,15 @@ int main(int argc, char** argv)
             std::cout << result.body;
         }
         else if (cmd == "zip") {
-            std::string src = readfile(argv[2]);
-            std::string out = gzip(src);
+            // zip [-j threads] file; -j 0 uses every core
+            unsigned threads = 1;
+            int arg = 2;
+            if (std::string(argv[arg]) == "-j" && argc > arg + 2) {
+                threads = unsigned(std::atoi(argv[arg + 1]));
+                arg += 2;
+            }
+            std::string src = readfile(argv[arg]);
+            std::string out = gzip(src, threads);
             std::cerr << "Deflated " << src.size() << " bytes to " << out.size() << "\n";
             std::cout << out;
         }
@@ -60,6 +69,16 @@ int main(int argc, char** argv)
             std::cerr << "Inflated " << src.size() << " bytes to " << out.size() << "\n";
             std::cout << out;
         }
+        else if (cmd == "train") {
+            std::vector<std::string> samples;
+            for (int i = 2; i < argc; ++i)
+                samples.push_back(readfile(argv[i]));
+            dictionary dict = dictionary::train(samples);
+            std::cerr << "Trained dictionary " << dict.id() << " of "
+                      << dict.content().size() << " bytes on "
+                      << samples.size() << " samples\n";
+            std::cout << dict.content();
+        }
         else {
             std::cerr << "Unrecognized command.\n";
             return 1;
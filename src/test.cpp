@@ -0,0 +1,1152 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hurl.h"
+
+//
+// Tests for hurl, run against an origin server in the same process. Each
+// test prints its failed checks; the exit status is the number of tests
+// that failed.
+//
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { ++failures; \
+        std::cout << "    " << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; } } while (0)
+
+//
+// origin: an HTTP server on an ephemeral loopback port that answers each
+// request with whatever its handler returns
+//
+struct request
+{
+    std::string method;
+    std::string target;
+    std::map<std::string, std::string> headers;     // names lowercased
+    std::string body;
+
+    std::string header(std::string const& name) const
+    {
+        std::map<std::string, std::string>::const_iterator it = headers.find(name);
+        return it == headers.end() ? std::string() : it->second;
+    }
+};
+
+struct response
+{
+    int status;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    long drip_ms = 0;   // if set, the body is sent a byte at a time, this far apart
+};
+
+class origin
+{
+public:
+    typedef std::function<response(request const&)> handler;
+
+    explicit origin(handler h) : state_(std::make_shared<state>()), port_(0)
+    {
+        state_->respond = h;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t size = sizeof(addr);
+        if (fd == -1 || bind(fd, (sockaddr*)&addr, size) || listen(fd, 16) ||
+                getsockname(fd, (sockaddr*)&addr, &size))
+            throw std::runtime_error("origin: could not listen");
+        port_ = ntohs(addr.sin_port);
+        std::thread(&origin::serve, fd, state_).detach();
+    }
+
+    std::string url() const
+    {
+        std::ostringstream url;
+        url << "http://127.0.0.1:" << port_;
+        return url.str();
+    }
+
+    // Requests received so far
+    std::vector<request> requests() const
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->received;
+    }
+
+private:
+    // Shared with the serving threads, which outlive the origin
+    struct state
+    {
+        handler respond;
+        mutable std::mutex mutex;
+        std::vector<request> received;
+    };
+
+    static void serve(int fd, std::shared_ptr<state> s)
+    {
+        int conn;
+        while ((conn = accept(fd, NULL, NULL)) != -1)
+            std::thread(&origin::answer, conn, s).detach();
+    }
+
+    static bool fill(int conn, std::string& pending)
+    {
+        char buf[1 << 16];
+        ssize_t n = read(conn, buf, sizeof(buf));
+        if (n <= 0)
+            return false;
+        pending.append(buf, n);
+        return true;
+    }
+
+    static bool until(int conn, std::string& pending, char const* delimiter, std::string& out)
+    {
+        size_t end;
+        while ((end = pending.find(delimiter)) == std::string::npos)
+            if (!fill(conn, pending))
+                return false;
+        out.assign(pending, 0, end);
+        pending.erase(0, end + std::strlen(delimiter));
+        return true;
+    }
+
+    static bool take(int conn, std::string& pending, size_t size, std::string& out)
+    {
+        while (pending.size() < size)
+            if (!fill(conn, pending))
+                return false;
+        out.append(pending, 0, size);
+        pending.erase(0, size);
+        return true;
+    }
+
+    static bool drip(int conn, std::string const& body, long ms)
+    {
+        for (size_t i = 0; i < body.size(); ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+            if (send(conn, &body[i], 1, MSG_NOSIGNAL) != 1)
+                return false;
+        }
+        return true;
+    }
+
+    static void answer(int conn, std::shared_ptr<state> s)
+    {
+        std::string pending, head, line;
+        while (until(conn, pending, "\r\n\r\n", head))
+        {
+            request req;
+            std::istringstream lines(head);
+            std::getline(lines, line);
+            std::istringstream first(line);
+            first >> req.method >> req.target;
+            while (std::getline(lines, line))
+            {
+                size_t colon = line.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                std::string name = line.substr(0, colon);
+                for (size_t i = 0; i < name.size(); ++i)
+                    name[i] = char(std::tolower((unsigned char)name[i]));
+                size_t start = line.find_first_not_of(' ', colon + 1);
+                size_t end = line.find_last_not_of("\r ");
+                req.headers[name] = start == std::string::npos || end < start ?
+                    std::string() : line.substr(start, end - start + 1);
+            }
+
+            bool ok = true;
+            if (strcasecmp(req.header("transfer-encoding").c_str(), "chunked") == 0)
+            {
+                size_t size;
+                do
+                {
+                    std::string crlf;
+                    ok = until(conn, pending, "\r\n", line);
+                    size = std::strtoul(line.c_str(), NULL, 16);
+                    ok = ok && take(conn, pending, size, req.body) &&
+                         take(conn, pending, 2, crlf);
+                } while (ok && size > 0);
+            }
+            else
+            {
+                ok = take(conn, pending, std::strtoul(req.header("content-length").c_str(),
+                                                      NULL, 10), req.body);
+            }
+            if (!ok)
+                break;
+
+            {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                s->received.push_back(req);
+            }
+            response resp = s->respond(req);
+            std::ostringstream out;
+            out << "HTTP/1.1 " << resp.status << " X\r\n";
+            for (size_t i = 0; i < resp.headers.size(); ++i)
+                out << resp.headers[i].first << ": " << resp.headers[i].second << "\r\n";
+            out << "Content-Length: " << resp.body.size() << "\r\n\r\n";
+            if (resp.drip_ms == 0)
+                out << resp.body;
+            std::string text = out.str();
+            if (write(conn, text.data(), text.size()) < 0)
+                break;
+            if (resp.drip_ms != 0 && !drip(conn, resp.body, resp.drip_ms))
+                break;
+        }
+        close(conn);
+    }
+
+    std::shared_ptr<state> state_;
+    int port_;
+};
+
+std::string temporary_directory()
+{
+    char name[] = "/tmp/hurl-test-XXXXXX";
+    if (!mkdtemp(name))
+        throw std::runtime_error("could not make a temporary directory");
+    return name;
+}
+
+size_t files(std::string const& directory)
+{
+    size_t count = 0;
+    if (DIR* d = opendir(directory.c_str()))
+    {
+        while (dirent* e = readdir(d))
+            count += e->d_name[0] != '.';
+        closedir(d);
+    }
+    return count;
+}
+
+//
+// cache tiers: an entry a disk-backed client copied into a shared memory
+// cache is revalidated and served stale by a client without the disk cache
+//
+response validated(request const& req)
+{
+    response resp = { 200, { { "ETag", "\"v1\"" } }, "hello" };
+    if (req.target == "/stale")
+        resp.headers.push_back(std::make_pair("Cache-Control", "max-age=2, stale-while-revalidate=60"));
+    else
+        resp.headers.push_back(std::make_pair("Cache-Control", "max-age=2"));
+    if (req.header("if-none-match") == "\"v1\"")
+    {
+        resp.status = 304;
+        resp.body.clear();
+    }
+    return resp;
+}
+
+void test_cache_tiers()
+{
+    origin server(validated);
+    std::shared_ptr<hurl::cache> memory = std::make_shared<hurl::cache>(1 << 20, 4);
+    std::shared_ptr<hurl::diskcache> disk =
+        std::make_shared<hurl::diskcache>(temporary_directory(), 1 << 20);
+
+    // Stored on disk, then copied into memory while still fresh
+    hurl::client writer(server.url());
+    writer.setdiskcache(disk);
+    CHECK(writer.get("/fresh").body == "hello");
+    CHECK(writer.get("/stale").body == "hello");
+    hurl::client both(server.url());
+    both.setcache(memory);
+    both.setdiskcache(disk);
+    CHECK(both.get("/fresh").body == "hello");
+    CHECK(both.get("/stale").body == "hello");
+    CHECK(disk->stats().hits == 2);
+    CHECK(memory->stats().entries == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(3100));
+
+    // Found stale in memory by clients without the disk cache
+    hurl::client memoryonly(server.url());
+    memoryonly.setcache(memory);
+    hurl::httpresponse revalidated = memoryonly.get("/fresh");
+    CHECK(revalidated.status == 200);
+    CHECK(revalidated.body == "hello");
+    CHECK(memory->stats().revalidations == 1);
+    CHECK(disk->stats().revalidations == 0);
+
+    both.setdiskcache(nullptr);
+    CHECK(both.get("/stale").body == "hello");
+    CHECK(memory->stats().stale == 1);
+    CHECK(disk->stats().stale == 0);
+
+    // A disk-only client revalidates its own entry
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    hurl::client diskonly(server.url());
+    diskonly.setdiskcache(disk);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    CHECK(diskonly.get("/fresh").body == "hello");
+    CHECK(disk->stats().revalidations == 1);
+}
+
+//
+// disk cache bodies: identical bodies are stored once, named by their
+// SHA-256 digest
+//
+response sized(request const& req)
+{
+    size_t size = std::strtoul(req.target.c_str() + req.target.rfind('/') + 1, NULL, 10);
+    response resp = { 200, { { "Cache-Control", "max-age=60" } }, std::string(size, 'x') };
+    return resp;
+}
+
+void test_disk_bodies()
+{
+    origin server(sized);
+    std::string directory = temporary_directory();
+    std::shared_ptr<hurl::diskcache> disk = std::make_shared<hurl::diskcache>(directory, 1 << 20);
+    hurl::client c(server.url());
+    c.setdiskcache(disk);
+    CHECK(c.get("/a/1000").body.size() == 1000);
+    CHECK(c.get("/b/1000").body.size() == 1000);
+    CHECK(c.get("/c/55").body.size() == 55);
+    CHECK(c.get("/d/0").body.empty());
+
+    std::string data = directory + "/data/";
+    CHECK(access((data + "44f8354494a5ba03ba1792a8d3e9c534c47a9181980fde7a3f44b06ef2ae7c7f").c_str(), F_OK) == 0);
+    CHECK(access((data + "d5e285683cd4efc02d021a5c62014694958901005d6f71e89e0989fac77e4072").c_str(), F_OK) == 0);
+    CHECK(access((data + "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855").c_str(), F_OK) == 0);
+    CHECK(disk->stats().entries == 4);
+    CHECK(files(data) == 3);
+
+    hurl::client reader(server.url());
+    reader.setdiskcache(disk);
+    CHECK(reader.get("/b/1000").body == std::string(1000, 'x'));
+    CHECK(disk->stats().hits == 1);
+    CHECK(server.requests().size() == 4);
+}
+
+//
+// coalescing: identical GETs made together share one transfer, and each
+// caller's miss is counted once
+//
+response slow(request const&)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    response resp = { 200, { { "Cache-Control", "max-age=60" } }, "slow" };
+    return resp;
+}
+
+void test_coalescing()
+{
+    origin server(slow);
+    std::shared_ptr<hurl::cache> memory = std::make_shared<hurl::cache>(1 << 20, 4);
+    hurl::setcache(memory);
+    hurl::setcoalescing(true);
+
+    std::vector<std::thread> callers;
+    std::atomic<int> served(0);
+    for (int i = 0; i < 4; ++i)
+        callers.push_back(std::thread([&]()
+        {
+            if (hurl::get(server.url() + "/shared").body == "slow")
+                ++served;
+        }));
+    for (size_t i = 0; i < callers.size(); ++i)
+        callers[i].join();
+    hurl::setcoalescing(false);
+    hurl::setcache(nullptr);
+
+    CHECK(served == 4);
+    CHECK(server.requests().size() == 1);
+    CHECK(memory->stats().misses == 4);
+    CHECK(memory->stats().stores == 1);
+}
+
+//
+// hedging: a hedge started while the first request is running carries
+// the request's headers
+//
+std::atomic<int> hedged_requests(0);
+
+response hedged(request const&)
+{
+    bool first = hedged_requests++ == 0;
+    if (first)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    response resp = { 200, {}, first ? "first" : "second" };
+    return resp;
+}
+
+void test_hedging()
+{
+    origin server(hedged);
+    hurl::client c(server.url());
+    hurl::httpoptions options;
+    options.retry = hurl::retrypolicy();
+    options.retry->attempts = 1;
+    options.hedge = hurl::hedgepolicy();
+    options.hedge->enabled = true;
+    options.hedge->delay_ms = 200;
+    options.hedge->percentile = 0;
+
+    CHECK(c.get("/", options).body == "second");
+    std::vector<request> received = server.requests();
+    CHECK(received.size() == 2);
+    CHECK(received.size() == 2 && !received[0].header("accept-encoding").empty() &&
+          received[0].header("accept-encoding") == received[1].header("accept-encoding"));
+}
+
+//
+// breaker trials: a trial that ends without a verdict on the host, from a
+// failing body callback or the caller's deadline, gives its place back
+//
+response by_path(request const& req)
+{
+    if (req.target == "/slow")
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    response resp = { req.target == "/fail" ? 500 : 200, {}, "" };
+    return resp;
+}
+
+size_t failing_read(char*, size_t)
+{
+    throw std::runtime_error("no body");
+}
+
+template<typename F>
+bool rejected(F request)
+{
+    try
+    {
+        request();
+        return false;
+    }
+    catch (hurl::circuit_open const&)
+    {
+        return true;
+    }
+}
+
+void test_breaker_trials()
+{
+    origin server(by_path);
+    std::string url = server.url();
+    hurl::breakerpolicy breaker;
+    breaker.enabled = true;
+    breaker.failures = 1;
+    breaker.open_ms = 200;
+    breaker.trials = 1;
+    hurl::setbreaker(breaker);
+
+    CHECK(hurl::get(url + "/fail").status == 500);
+    CHECK(rejected([&]() { hurl::get(url + "/ok"); }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    bool threw = false;
+    try
+    {
+        hurl::post(url + "/ok", hurl::httpbody::callback(&failing_read, 10));
+    }
+    catch (hurl::circuit_open const&)
+    {
+    }
+    catch (std::runtime_error const&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(hurl::get(url + "/ok").status == 200);
+
+    // Closed again; two failures in a row open it
+    breaker.failures = 2;
+    hurl::setbreaker(breaker);
+    CHECK(hurl::get(url + "/fail").status == 500);
+    CHECK(hurl::get(url + "/fail").status == 500);
+    CHECK(rejected([&]() { hurl::get(url + "/ok"); }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    hurl::httpoptions options;
+    options.deadline = hurl::deadline(hurl::deadline::clock::now() + std::chrono::milliseconds(100));
+    bool late = false;
+    try
+    {
+        hurl::get(url + "/slow", options);
+    }
+    catch (hurl::deadline_exceeded const&)
+    {
+        late = true;
+    }
+    CHECK(late);
+
+    // Still half open, so one more failure opens it
+    CHECK(hurl::get(url + "/fail").status == 500);
+    CHECK(rejected([&]() { hurl::get(url + "/ok"); }));
+    hurl::setbreaker(hurl::breakerpolicy());
+}
+
+//
+// memory bodies: bodies in memory are sent whole, by the right method,
+// and again on a retry
+//
+std::atomic<int> unavailable(0);
+
+response echo(request const& req)
+{
+    response resp = { 200, {}, req.method + " " + req.body };
+    if (req.target == "/retry" && unavailable++ == 0)
+        resp.status = 503;
+    return resp;
+}
+
+void test_memory_bodies()
+{
+    origin server(echo);
+    hurl::client c(server.url());
+    hurl::compressionpolicy none;
+    none.algorithm = hurl::compressionpolicy::none;
+    c.setcompression(none);
+    std::string data(100000, 'x');
+
+    CHECK(c.post("/", hurl::httpbody::view(data)).body == "POST " + data);
+    CHECK(c.put("/", hurl::httpbody::buffer(std::make_shared<std::string const>("abc"))).body ==
+          "PUT abc");
+    CHECK(c.post("/", hurl::httpbody::view(std::string_view())).body == "POST ");
+    CHECK(c.post("/", std::string("a=b")).body == "POST a=b");
+    std::vector<request> received = server.requests();
+    CHECK(received.size() == 4 && received[0].header("content-length") == "100000");
+    CHECK(received.size() == 4 && received[2].header("content-length") == "0");
+
+    hurl::httpoptions options;
+    options.retry = hurl::retrypolicy();
+    options.retry->attempts = 2;
+    options.retry->backoff_ms = 1;
+    options.retry->retry_post = true;
+    CHECK(c.post("/retry", hurl::httpbody::view(data), options).body == "POST " + data);
+    CHECK(server.requests().size() == 6);
+}
+
+//
+// upload compression: only string bodies are compressed unless a policy
+// is set, and bodies of known size are compressed in full and sent with
+// a Content-Length
+//
+response accepting(request const& req)
+{
+    response resp = { 200, {}, "" };
+    if (req.target == "/retry" && unavailable++ == 0)
+        resp.status = 503;
+    return resp;
+}
+
+bool gzipped(request const& req)
+{
+    return req.header("content-encoding") == "gzip" && req.body.size() > 2 &&
+           req.body[0] == '\x1f' && req.body[1] == '\x8b';
+}
+
+// A body of size bytes of 'y' read through a callback
+hurl::httpbody::reader repeated(size_t size)
+{
+    std::shared_ptr<size_t> left = std::make_shared<size_t>(size);
+    return [left](char* buffer, size_t room)
+    {
+        room = std::min(room, *left);
+        std::memset(buffer, 'y', room);
+        *left -= room;
+        return room;
+    };
+}
+
+void test_upload_compression()
+{
+    origin server(accepting);
+    hurl::client c(server.url());
+    std::string data(100000, 'x');
+
+    // Unset: string posts only
+    c.post("/", data);
+    c.post("/", hurl::httpbody::view(data));
+    c.put("/", hurl::httpbody::view(data));
+    std::vector<request> received = server.requests();
+    CHECK(received.size() == 3);
+    CHECK(received.size() == 3 && gzipped(received[0]));
+    CHECK(received.size() == 3 && received[0].header("content-length") ==
+          std::to_string(received[0].body.size()));
+    CHECK(received.size() == 3 && received[0].header("transfer-encoding").empty());
+    CHECK(received.size() == 3 && received[1].header("content-encoding").empty());
+    CHECK(received.size() == 3 && received[2].body == data);
+
+    // Set: bodies of known size get a Content-Length, others are chunked
+    c.setcompression(hurl::compressionpolicy());
+    c.put("/", hurl::httpbody::view(data));
+    c.post("/", hurl::httpbody::callback(repeated(100000)));
+    received = server.requests();
+    CHECK(received.size() == 5);
+    CHECK(received.size() == 5 && gzipped(received[3]) && received[3].method == "PUT");
+    CHECK(received.size() == 5 && received[3].header("content-length") ==
+          std::to_string(received[3].body.size()));
+    CHECK(received.size() == 5 && gzipped(received[4]));
+    CHECK(received.size() == 5 && received[4].header("transfer-encoding") == "chunked");
+
+    // A retry sends the same compressed bytes, even of a callback body
+    unavailable = 0;
+    hurl::httpoptions options;
+    options.retry = hurl::retrypolicy();
+    options.retry->attempts = 2;
+    options.retry->backoff_ms = 1;
+    options.retry->retry_post = true;
+    CHECK(c.post("/retry", hurl::httpbody::callback(repeated(100000), 100000), options).status == 200);
+    received = server.requests();
+    CHECK(received.size() == 7);
+    CHECK(received.size() == 7 && gzipped(received[5]) && received[5].body == received[6].body);
+}
+
+//
+// compressed replay: a retry of a streamed compressed body sends the
+// output kept from the first attempt, without reading the body again
+//
+class counted : public std::stringbuf
+{
+public:
+    explicit counted(std::string const& data) : std::stringbuf(data), served(0) {}
+
+    std::streamsize served;
+
+protected:
+    std::streamsize xsgetn(char* s, std::streamsize n)
+    {
+        std::streamsize got = std::stringbuf::xsgetn(s, n);
+        served += got;
+        return got;
+    }
+};
+
+void test_compressed_replay()
+{
+    origin server(accepting);
+    hurl::client c(server.url());
+    c.setcompression(hurl::compressionpolicy());
+    hurl::httpoptions options;
+    options.retry = hurl::retrypolicy();
+    options.retry->attempts = 2;
+    options.retry->backoff_ms = 1;
+    options.retry->retry_post = true;
+
+    counted buf(std::string(200000, 'z'));
+    std::istream in(&buf);
+    unavailable = 0;
+    CHECK(c.post("/retry", hurl::httpbody::stream(in), options).status == 200);
+    std::vector<request> received = server.requests();
+    CHECK(received.size() == 2);
+    CHECK(received.size() == 2 && received[0].header("transfer-encoding") == "chunked");
+    CHECK(received.size() == 2 && gzipped(received[1]) && received[0].body == received[1].body);
+
+    // Read once, after the 4 KB sample that judged it worth compressing
+    CHECK(buf.served == 200000 + 4096);
+}
+
+//
+// coalesced deadlines: a follower isn't failed by the leader's deadline,
+// and makes the request again itself
+//
+void test_coalesced_deadlines()
+{
+    origin server(slow);
+    hurl::setcoalescing(true);
+
+    bool leader_late = false;
+    std::thread leader([&]()
+    {
+        hurl::httpoptions options;
+        options.deadline = hurl::deadline::after(50);
+        try
+        {
+            hurl::get(server.url() + "/shared", options);
+        }
+        catch (hurl::deadline_exceeded const&)
+        {
+            leader_late = true;
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::string body;
+    try
+    {
+        body = hurl::get(server.url() + "/shared").body;
+    }
+    catch (std::exception const& e)
+    {
+        body = e.what();
+    }
+    leader.join();
+    hurl::setcoalescing(false);
+
+    CHECK(leader_late);
+    CHECK(body == "slow");
+    CHECK(server.requests().size() == 2);
+}
+
+//
+// refreshes: each cache refreshes its own stale entries, and only so many
+// refreshes run at once
+//
+response slow_revalidation(request const& req)
+{
+    response resp = { 200, { { "ETag", "\"v1\"" },
+                             { "Cache-Control", "max-age=1, stale-while-revalidate=60" } },
+                      "hello" };
+    if (req.header("if-none-match") == "\"v1\"")
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        resp.status = 304;
+        resp.body.clear();
+    }
+    return resp;
+}
+
+size_t revalidations(origin const& server)
+{
+    std::vector<request> received = server.requests();
+    size_t count = 0;
+    for (size_t i = 0; i < received.size(); ++i)
+        count += !received[i].header("if-none-match").empty();
+    return count;
+}
+
+void test_refreshes()
+{
+    origin server(slow_revalidation);
+    hurl::client a(server.url()), b(server.url());
+    a.setcache(std::make_shared<hurl::cache>(1 << 20, 4));
+    b.setcache(std::make_shared<hurl::cache>(1 << 20, 4));
+    CHECK(a.get("/same").body == "hello");
+    CHECK(b.get("/same").body == "hello");
+    for (int i = 0; i < 40; ++i)
+        CHECK(a.get("/storm/" + std::to_string(i)).body == "hello");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+
+    CHECK(a.get("/same").body == "hello");
+    CHECK(b.get("/same").body == "hello");
+    for (int i = 0; i < 40; ++i)
+        a.get("/storm/" + std::to_string(i));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // One for /same in each cache, and the storm up to the cap of 16
+    CHECK(revalidations(server) == 16);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+}
+
+//
+// retries: attempts, backoff, Retry-After, idempotency and the budget.
+// The origin answers a target "/<name>/<status>,<status>,..." with each
+// status in turn, repeating the last; "?after=<value>" adds Retry-After
+// to errors.
+//
+std::mutex script_mutex;
+std::map<std::string, size_t> script_calls;
+
+response scripted(request const& req)
+{
+    std::string path = req.target.substr(0, req.target.find('?'));
+    std::vector<int> statuses;
+    std::istringstream list(path.substr(path.rfind('/') + 1));
+    std::string status;
+    while (std::getline(list, status, ','))
+        statuses.push_back(std::atoi(status.c_str()));
+
+    size_t call;
+    {
+        std::lock_guard<std::mutex> lock(script_mutex);
+        call = script_calls[req.target]++;
+    }
+    response resp = { statuses[std::min(call, statuses.size() - 1)], {}, "" };
+    size_t after = req.target.find("?after=");
+    if (resp.status >= 400 && after != std::string::npos)
+        resp.headers.push_back(std::make_pair("Retry-After", req.target.substr(after + 7)));
+    return resp;
+}
+
+hurl::retrypolicy no_jitter(int attempts)
+{
+    hurl::retrypolicy policy;
+    policy.attempts = attempts;
+    policy.backoff_ms = 10;
+    policy.jitter = false;
+    return policy;
+}
+
+long elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+    return long(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - since).count());
+}
+
+void test_retries()
+{
+    origin server(scripted);
+    hurl::client c(server.url());
+    c.setretry(no_jitter(3));
+    size_t sent = 0;
+
+    // Retried until success, or until the attempts run out
+    hurl::httpstats before = hurl::stats();
+    CHECK(c.get("/a/503,502,200").status == 200);
+    CHECK(server.requests().size() == (sent += 3));
+    CHECK(c.get("/b/504").status == 504);
+    CHECK(server.requests().size() == (sent += 3));
+    hurl::httpstats after = hurl::stats();
+    CHECK(after.attempts - before.attempts == 6);
+    CHECK(after.retries - before.retries == 4);
+    CHECK(after.exhausted - before.exhausted == 1);
+
+    // Not retried: other errors, and POSTs unless 429 or retry_post
+    CHECK(c.get("/c/500,200").status == 500);
+    CHECK(c.get("/d/404,200").status == 404);
+    CHECK(c.post("/e/503,200", std::string("x")).status == 503);
+    CHECK(c.post("/f/408,200", std::string("x")).status == 408);
+    CHECK(c.post("/g/429,200", std::string("x")).status == 200);
+    CHECK(server.requests().size() == (sent += 6));
+    hurl::httpoptions options;
+    options.retry = no_jitter(2);
+    options.retry->retry_post = true;
+    CHECK(c.post("/h/502,200", std::string("x"), options).status == 200);
+    CHECK(server.requests().size() == (sent += 2));
+
+    // Backoff grows by multiplier up to max_backoff_ms: 50, 100, 100
+    options.retry = no_jitter(4);
+    options.retry->backoff_ms = 50;
+    options.retry->multiplier = 10;
+    options.retry->max_backoff_ms = 100;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CHECK(c.get("/i/503", options).status == 503);
+    long took = elapsed_ms(start);
+    CHECK(took >= 250 && took < 1000);
+    CHECK(server.requests().size() == (sent += 4));
+
+    // Retry-After is waited for, unless it is more than max_backoff_ms
+    options.retry = no_jitter(2);
+    options.retry->max_backoff_ms = 2000;
+    start = std::chrono::steady_clock::now();
+    CHECK(c.get("/j/503,200?after=1", options).status == 200);
+    CHECK(elapsed_ms(start) >= 1000);
+    options.retry->max_backoff_ms = 500;
+    start = std::chrono::steady_clock::now();
+    CHECK(c.get("/k/503,200?after=1", options).status == 503);
+    CHECK(elapsed_ms(start) < 500);
+    options.retry->retry_after = false;
+    CHECK(c.get("/l/503,200?after=1", options).status == 200);
+    CHECK(server.requests().size() == (sent += 5));
+
+    // Once the budget is spent, failures are not retried
+    hurl::client thrifty(server.url());
+    hurl::retrypolicy budget = no_jitter(3);
+    budget.budget_ratio = 0;
+    budget.budget_burst = 2;
+    thrifty.setretry(budget);
+    before = hurl::stats();
+    CHECK(thrifty.get("/m/503,503,200").status == 200);
+    CHECK(thrifty.get("/n/503,200").status == 503);
+    after = hurl::stats();
+    CHECK(after.over_budget - before.over_budget == 1);
+    CHECK(server.requests().size() == (sent += 4));
+}
+
+//
+// limits: the connect, first-byte, whole-transfer and stall limits each
+// fail a transfer with hurl::timeout
+//
+response dawdling(request const& req)
+{
+    response resp = { 200, {}, "dawdling" };
+    if (req.target == "/late")
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    else if (req.target == "/drip")
+        resp.drip_ms = 400;
+    return resp;
+}
+
+template<typename F>
+bool timed_out(F request, long& took)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try
+    {
+        request();
+        took = elapsed_ms(start);
+        return false;
+    }
+    catch (hurl::timeout const&)
+    {
+        took = elapsed_ms(start);
+        return true;
+    }
+}
+
+void test_limits()
+{
+    origin server(dawdling);
+    hurl::client c(server.url());
+    long took = 0;
+
+    // A listener that never accepts, with its one-place queue already
+    // taken, leaves the next connection unanswered
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(addr);
+    CHECK(bind(fd, (sockaddr*)&addr, size) == 0 && listen(fd, 0) == 0 &&
+          getsockname(fd, (sockaddr*)&addr, &size) == 0);
+    int queued = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(connect(queued, (sockaddr*)&addr, size) == 0);
+    std::ostringstream unanswered;
+    unanswered << "http://127.0.0.1:" << ntohs(addr.sin_port);
+    hurl::httpoptions connecting;
+    connecting.connect_timeout_ms = 200;
+    CHECK(timed_out([&]() { hurl::get(unanswered.str() + "/", connecting); }, took));
+    CHECK(took >= 190 && took < 900);
+    close(queued);
+    close(fd);
+
+    // First byte: late headers fail, unless the limit allows for them
+    hurl::httpoptions first_byte;
+    first_byte.first_byte_timeout_ms = 200;
+    CHECK(timed_out([&]() { c.get("/late", first_byte); }, took));
+    CHECK(took >= 190 && took < 900);
+    first_byte.first_byte_timeout_ms = 2000;
+    CHECK(!timed_out([&]() { c.get("/late", first_byte); }, took));
+
+    // Whole transfer
+    hurl::httpoptions whole;
+    whole.timeout_ms = 300;
+    CHECK(timed_out([&]() { c.get("/late", whole); }, took));
+    CHECK(took >= 290 && took < 900);
+    CHECK(!timed_out([&]() { c.get("/prompt", whole); }, took));
+
+    // Stall: a body dripping at 2.5 bytes a second is under 100 for 1 second
+    hurl::httpoptions stall;
+    stall.low_speed_limit = 100;
+    stall.low_speed_time = 1;
+    CHECK(timed_out([&]() { c.get("/drip", stall); }, took));
+    CHECK(took >= 900 && took < 3000);
+    CHECK(!timed_out([&]() { c.get("/prompt", stall); }, took));
+}
+
+//
+// deadlines: a passed deadline refuses a request without making it, and
+// a chain of requests under one deadline gets only the time left
+//
+void test_deadlines()
+{
+    origin server(slow);
+    hurl::client c(server.url());
+    hurl::httpoptions options;
+
+    options.deadline = hurl::deadline::after(0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    bool refused = false;
+    try
+    {
+        c.get("/passed", options);
+    }
+    catch (hurl::deadline_exceeded const&)
+    {
+        refused = true;
+    }
+    CHECK(refused);
+    CHECK(server.requests().empty());
+
+    // 500 ms covers the first 300 ms request but not the second
+    options.deadline = hurl::deadline::after(500);
+    CHECK(c.get("/first", options).body == "slow");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool late = false;
+    try
+    {
+        c.get("/second", options);
+    }
+    catch (hurl::deadline_exceeded const&)
+    {
+        late = true;
+    }
+    CHECK(late);
+    CHECK(elapsed_ms(start) < 280);
+    CHECK(server.requests().size() == 2);
+
+    // Likewise for the client's deadline
+    c.setdeadline(hurl::deadline::after(500));
+    CHECK(c.get("/third").body == "slow");
+    start = std::chrono::steady_clock::now();
+    late = false;
+    try
+    {
+        c.get("/fourth");
+    }
+    catch (hurl::deadline_exceeded const&)
+    {
+        late = true;
+    }
+    CHECK(late);
+    CHECK(elapsed_ms(start) < 280);
+}
+
+//
+// multipart: each part between boundary lines with quoted names, then
+// the closing delimiter; a form of sized parts, files included, is sent
+// with a Content-Length
+//
+
+// The parts of a multipart body, each as headers and content; closed is
+// set if the closing delimiter ends it
+std::vector<std::pair<std::string, std::string>> multipart_parts(std::string const& body,
+                                                                 std::string const& boundary,
+                                                                 bool& closed)
+{
+    std::vector<std::pair<std::string, std::string>> parts;
+    std::string delimiter = "--" + boundary;
+    closed = false;
+    if (body.compare(0, delimiter.size() + 2, delimiter + "\r\n") != 0)
+        return parts;
+    size_t at = delimiter.size() + 2;
+    size_t next;
+    while ((next = body.find("\r\n" + delimiter, at)) != std::string::npos)
+    {
+        std::string part = body.substr(at, next - at);
+        size_t blank = part.find("\r\n\r\n");
+        if (blank == std::string::npos)
+            return parts;
+        parts.push_back(std::make_pair(part.substr(0, blank + 2), part.substr(blank + 4)));
+        at = next + 2 + delimiter.size();
+        if (body.compare(at, std::string::npos, "--\r\n") == 0)
+        {
+            closed = true;
+            break;
+        }
+        if (body.compare(at, 2, "\r\n") != 0)
+            break;
+        at += 2;
+    }
+    return parts;
+}
+
+void test_multipart()
+{
+    origin server(echo);
+    hurl::client c(server.url());
+    std::string path = temporary_directory() + "/data.bin";
+    std::string data = std::string(70000, 'f') + std::string("\0\r\n--", 5);
+    std::ofstream(path, std::ios::binary) << data;
+
+    hurl::multipart form;
+    form.field("say \"hi\"\r\n", "value")
+        .file("upload", path)
+        .part("stream", hurl::httpbody::callback(repeated(1000), 1000), "y\"s.txt", "text/plain");
+    CHECK(c.post("/", form).status == 200);
+
+    std::string type = form.content_type();
+    std::string boundary = type.substr(type.find("boundary=") + 9);
+    std::vector<request> received = server.requests();
+    CHECK(received.size() == 1);
+    request const& sent = received[0];
+    CHECK(sent.header("content-type") == type);
+    CHECK(sent.header("transfer-encoding").empty());
+    CHECK(sent.header("content-length") == std::to_string(sent.body.size()));
+
+    bool closed;
+    std::vector<std::pair<std::string, std::string>> parts =
+        multipart_parts(sent.body, boundary, closed);
+    CHECK(closed);
+    CHECK(parts.size() == 3);
+    if (parts.size() == 3)
+    {
+        CHECK(parts[0].first == "Content-Disposition: form-data; name=\"say %22hi%22%0D%0A\"\r\n");
+        CHECK(parts[0].second == "value");
+        CHECK(parts[1].first == "Content-Disposition: form-data; name=\"upload\"; "
+                                "filename=\"data.bin\"\r\n"
+                                "Content-Type: application/octet-stream\r\n");
+        CHECK(parts[1].second == data);
+        CHECK(parts[2].first == "Content-Disposition: form-data; name=\"stream\"; "
+                                "filename=\"y%22s.txt\"\r\n"
+                                "Content-Type: text/plain\r\n");
+        CHECK(parts[2].second == std::string(1000, 'y'));
+    }
+
+    // A part of unknown size makes the whole chunked
+    hurl::multipart unsized;
+    unsized.part("stream", hurl::httpbody::callback(repeated(1000)));
+    CHECK(c.post("/", unsized).status == 200);
+    received = server.requests();
+    CHECK(received.size() == 2);
+    if (received.size() == 2)
+    {
+        CHECK(received[1].header("transfer-encoding") == "chunked");
+        type = unsized.content_type();
+        parts = multipart_parts(received[1].body, type.substr(type.find("boundary=") + 9), closed);
+        CHECK(closed);
+        CHECK(parts.size() == 1 && parts[0].second == std::string(1000, 'y'));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct test
+    {
+        char const* name;
+        void (*run)();
+    };
+    static const test tests[] = {
+        { "cache_tiers", &test_cache_tiers },
+        { "disk_bodies", &test_disk_bodies },
+        { "coalescing", &test_coalescing },
+        { "coalesced_deadlines", &test_coalesced_deadlines },
+        { "refreshes", &test_refreshes },
+        { "retries", &test_retries },
+        { "limits", &test_limits },
+        { "deadlines", &test_deadlines },
+        { "multipart", &test_multipart },
+        { "hedging", &test_hedging },
+        { "breaker_trials", &test_breaker_trials },
+        { "memory_bodies", &test_memory_bodies },
+        { "upload_compression", &test_upload_compression },
+        { "compressed_replay", &test_compressed_replay },
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+    {
+        if (argc > 1 && std::string(argv[1]) != tests[i].name)
+            continue;
+        std::cout << tests[i].name << "\n";
+        int before = failures;
+        try
+        {
+            tests[i].run();
+        }
+        catch (std::exception const& e)
+        {
+            ++failures;
+            std::cout << "    threw " << e.what() << "\n";
+        }
+        if (failures != before)
+            ++failed;
+    }
+    std::cout << (failed ? "FAILED" : "OK") << "\n";
+    return failed;
+}